@@ -1,12 +1,46 @@
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <random>
 #include <fstream>
 #include <filesystem>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#ifdef __linux__
+	#include <pthread.h>
+	#include <sched.h>
+	#include <sys/inotify.h>
+#endif
+
+#ifdef _WIN32
+	#define NOMINMAX
+	#include <winsock2.h>
+	#include <ws2tcpip.h>
+#else
+	#include <arpa/inet.h>
+	#include <fcntl.h>
+	#include <netdb.h>
+	#include <netinet/in.h>
+	#include <sys/mman.h>
+	#include <sys/socket.h>
+	#include <unistd.h>
+#endif
+
 #include "SDL2/SDL.h"
 
 // TODO: change this to probably a real function that doesnt exist in release
@@ -33,9 +67,33 @@ namespace Config
 	float maxClockSpeedMp = 3.0f;
 	float minClockSpeedMp = 0.25f;
 	char* romPath{};
+	char* goldenPath{};			// Manifest for the headless conformance suite
+	bool goldenRecord = false;	// Rewrite the manifest hashes instead of checking them
+	char* diffPath{};			// Manifest for the differential engine checker
+	const char* diffEngines = "switch,table";
+	int diffInterval = 256;		// Instructions between state comparisons
+	int profileInterval = 0;	// Instructions between profiler samples, 0 is off
+	bool debugger = false;		// Attach the console debugger
+	bool hotReload = false;		// Reload the rom when the file changes
+	bool keepState = false;		// Re-apply the last save state after a reload
+	uint32_t seed = 0;			// Random number generator seed, 0 picks one
+	int netLocalPort = 0;		// Rollback netplay, 0 is off
+	char* netPeer{};			// host:port of the other player
+	int netDelayMs = 0;			// Simulated one way latency
+	int netJitterMs = 0;		// Simulated random extra latency
+	char* fuzzPath{};			// Seed rom or directory of seed roms for the fuzzer
+	const char* fuzzOut = "fuzz_out";
+	int fuzzSeconds = 60;		// 0 fuzzes until killed
+	int fuzzJobs = 0;			// 0 uses every core
+	int fuzzFrames = 120;		// Frames every fuzz input runs for
+	int hostInstances = 0;		// Machines for the hosting benchmark, 0 is off
+	int hostFrames = 600;
 	[[maybe_unused]] const char* beepSoundPath{"beep.wav"};
 	bool useBeepSound = false;	// uhh why it cant be maybe_unused?
 	constexpr uint32_t beepIconColor = 0x00EECC00;
+	int runAheadFrames = 0;		// Frames emulated ahead of the shown one, 0 is off
+	constexpr int maxRunAheadFrames = 8;
+	constexpr double frameTime = 1000.0 / 60.0;	// Frame budget in ms
 }
 
 namespace Global
@@ -45,19 +103,492 @@ namespace Global
 
 namespace Random
 {
-	std::mt19937 mt{std::random_device{}()};
+	// One engine per thread, machines get created on worker threads
+	thread_local std::mt19937 mt{std::random_device{}()};
 	int get(int min, int max)
 	{
 		return std::uniform_int_distribution{min, max}(mt);
 	}
 }
 
-class Chip8
+namespace Hash
+{
+	constexpr uint64_t fnvOffset = 0xcbf29ce484222325ull;
+
+	// 64 bit FNV-1a, chain calls by passing the previous hash
+	uint64_t fnv1a(const void* data, std::size_t len, uint64_t hash = fnvOffset)
+	{
+		const uint8_t* bytes = static_cast<const uint8_t*>(data);
+		for (std::size_t i = 0; i < len; i++)
+		{
+			hash ^= bytes[i];
+			hash *= 0x100000001b3ull;
+		}
+
+		return hash;
+	}
+}
+
+struct RamPage;
+
+// Bump allocator over big blocks of memory, backed by huge pages when the OS 
+// hands them out. Nothing is freed before the arena dies, the pools on top 
+// recycle what they got. Not thread safe apart from the ram page free list: a
+// worker owns its arena and touches the memory first, so it lands on the 
+// worker's NUMA node
+class Arena
+{
+private:
+	static constexpr std::size_t m_hugePage = 2 << 20;
+
+	struct Block
+	{
+		unsigned char* data;
+		std::size_t size;
+		bool huge;
+	};
+
+	std::vector<Block> m_blocks;
+	std::size_t m_offset{};		// Into the last block
+	std::size_t m_used{};
+	std::size_t m_blockSize;
+
+	// Ram pages come back here from whatever thread dropped them last
+	std::mutex m_pageMutex;
+	std::vector<RamPage*> m_freePages;
+
+	static Block map(std::size_t size)
+	{
+		size = (size + m_hugePage - 1) / m_hugePage * m_hugePage;
+#ifdef _WIN32
+		// Large pages need the lock memory privilege, most users don't have it
+		const SIZE_T large = GetLargePageMinimum();
+		if (large && size % large == 0)
+			if (void* data = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE))
+				return {static_cast<unsigned char*>(data), size, true};
+
+		void* data = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+		return {static_cast<unsigned char*>(data), size, false};
+#else
+	#ifdef MAP_HUGETLB
+		// Only works if the admin reserved huge pages
+		void* huge = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (huge != MAP_FAILED)
+			return {static_cast<unsigned char*>(huge), size, true};
+	#endif
+
+		void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (data == MAP_FAILED)
+			return {nullptr, 0, false};
+
+	#ifdef MADV_HUGEPAGE
+		// Fall back to transparent huge pages
+		madvise(data, size, MADV_HUGEPAGE);
+	#endif
+		return {static_cast<unsigned char*>(data), size, false};
+#endif
+	}
+
+	static void unmap(const Block& block)
+	{
+#ifdef _WIN32
+		VirtualFree(block.data, 0, MEM_RELEASE);
+#else
+		munmap(block.data, block.size);
+#endif
+	}
+
+public:
+	explicit Arena(std::size_t blockSize = m_hugePage) : m_blockSize{blockSize} {}
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+
+	~Arena()
+	{
+		for (const Block& block : m_blocks)
+			unmap(block);
+	}
+
+	// Returns nullptr when the OS is out of memory
+	void* allocate(std::size_t size, std::size_t align)
+	{
+		std::size_t offset = (m_offset + align - 1) & ~(align - 1);
+		if (m_blocks.empty() || offset + size > m_blocks.back().size)
+		{
+			const Block block = map(std::max(size, m_blockSize));
+			if (!block.data) return nullptr;
+
+			m_blocks.push_back(block);
+			offset = 0;
+		}
+
+		m_offset = offset + size;
+		m_used += size;
+		return m_blocks.back().data + offset;
+	}
+
+	void recycle(RamPage* page)
+	{
+		std::lock_guard lock{m_pageMutex};
+		m_freePages.push_back(page);
+	}
+
+	// Returns nullptr when no page was given back
+	RamPage* reuse()
+	{
+		std::lock_guard lock{m_pageMutex};
+		if (m_freePages.empty()) return nullptr;
+
+		RamPage* page = m_freePages.back();
+		m_freePages.pop_back();
+		return page;
+	}
+
+	std::size_t used() const {return m_used;}
+
+	std::size_t reserved() const
+	{
+		std::size_t size = 0;
+		for (const Block& block : m_blocks)
+			size += block.size;
+
+		return size;
+	}
+
+	bool hugePages() const
+	{
+		return !m_blocks.empty() && std::all_of(m_blocks.begin(), m_blocks.end(), [](const Block& b) {return b.huge;});
+	}
+};
+
+namespace Numa
+{
+	// The cores of every NUMA node we may run on. Without NUMA info it's a 
+	// single node with every core
+	std::vector<std::vector<int>> nodes()
+	{
+		std::vector<std::vector<int>> nodes;
+#ifdef __linux__
+		cpu_set_t allowed;
+		CPU_ZERO(&allowed);
+		const bool masked = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+		std::vector<std::filesystem::path> dirs;
+		std::error_code error;
+		for (const auto& entry : std::filesystem::directory_iterator{"/sys/devices/system/node", error})
+		{
+			const std::string name = entry.path().filename().string();
+			if (name.size() > 4 && name.compare(0, 4, "node") == 0 && isdigit(static_cast<unsigned char>(name[4])))
+				dirs.push_back(entry.path());
+		}
+		std::sort(dirs.begin(), dirs.end());
+
+		for (const std::filesystem::path& dir : dirs)
+		{
+			// Ranges like "0-3,8-11"
+			std::ifstream file{dir / "cpulist"};
+			std::vector<int> cpus;
+			std::string range;
+			while (std::getline(file, range, ','))
+			{
+				int first, last;
+				const int count = sscanf(range.c_str(), "%d-%d", &first, &last);
+				if (count < 1) continue;
+				if (count == 1) last = first;
+
+				for (int cpu = first; cpu <= last; cpu++)
+					if (!masked || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)))
+						cpus.push_back(cpu);
+			}
+
+			if (!cpus.empty())
+				nodes.push_back(std::move(cpus));
+		}
+#endif
+
+		if (nodes.empty())
+		{
+			nodes.emplace_back();
+			for (unsigned cpu = 0; cpu < std::max(std::thread::hardware_concurrency(), 1u); cpu++)
+				nodes.back().push_back(cpu);
+		}
+
+		return nodes;
+	}
+
+	// Pins the calling thread to a core, false if the OS wouldn't
+	bool pinThread(int cpu)
+	{
+#if defined(__linux__)
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#elif defined(_WIN32)
+		return cpu < 64 && SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR{1} << cpu) != 0;
+#else
+		(void)cpu;
+		return false;
+#endif
+	}
+}
+
+// A 256 byte slice of the chip8 ram. Forked machines share their pages and 
+// only copy one when they write to it
+struct alignas(64) RamPage
+{
+	static constexpr int size = 256;
+
+	std::array<uint8_t, size> data{};
+	std::atomic<uint32_t> refs{1};
+	Arena* owner{};		// Heap page if null, freed pages go back to their arena
+};
+
+namespace PagePool
+{
+	// Freed pages are kept per thread so forking in a hot loop rarely ends 
+	// up in the allocator
+	struct Cache
+	{
+		std::vector<RamPage*> pages;
+
+		~Cache()
+		{
+			for (RamPage* page : pages)
+				delete page;
+		}
+	};
+	thread_local Cache cache;
+	thread_local Arena* arena{};
+
+	// New pages of this thread come from the arena. Rams holding its pages 
+	// may move between threads, but they all have to be gone before the 
+	// arena is
+	void attach(Arena* owner)
+	{
+		arena = owner;
+	}
+
+	void detach(Arena* owner)
+	{
+		if (arena == owner)
+			arena = nullptr;
+	}
+
+	// The returned page has a single reference but its data is NOT cleared
+	RamPage* acquire()
+	{
+		RamPage* page{};
+		if (arena)
+		{
+			page = arena->reuse();
+			if (!page)
+				if (void* memory = arena->allocate(sizeof(RamPage), alignof(RamPage)))
+				{
+					page = new (memory) RamPage{};
+					page->owner = arena;
+				}
+		}
+
+		if (!page)
+		{
+			if (cache.pages.empty())
+				return new RamPage{};
+
+			page = cache.pages.back();
+			cache.pages.pop_back();
+		}
+
+		page->refs.store(1, std::memory_order_relaxed);
+		return page;
+	}
+
+	void release(RamPage* page)
+	{
+		if (page->owner)
+			page->owner->recycle(page);
+		else
+			cache.pages.push_back(page);
+	}
+}
+
+// The 4KB of chip8 ram split into copy-on-write pages. Copying it only bumps 
+// the page reference counts, which are atomic so copies can live on other 
+// threads
+class Ram
+{
+public:
+	static constexpr int size = 4096;
+	static constexpr int pageCount = size / RamPage::size;
+
+private:
+	std::array<RamPage*, pageCount> m_pages{};
+	uint16_t m_dirty{};		// One bit per page written since takeDirty()
+
+	static void unref(RamPage* page)
+	{
+		if (page->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			PagePool::release(page);
+	}
+
+	// Makes sure the page is owned only by this ram before writing into it
+	RamPage* ownPage(uint16_t addr)
+	{
+		const int index = (addr & (size - 1)) / RamPage::size;
+		RamPage*& page = m_pages[index];
+		m_dirty |= 1 << index;
+
+		if (page->refs.load(std::memory_order_acquire) != 1)
+		{
+			RamPage* copy = PagePool::acquire();
+			copy->data = page->data;
+			unref(page);
+			page = copy;
+		}
+
+		return page;
+	}
+
+public:
+	Ram()
+	{
+		for (RamPage*& page : m_pages)
+		{
+			page = PagePool::acquire();
+			page->data.fill(0);
+		}
+	}
+
+	Ram(const Ram& other) : m_pages{other.m_pages}, m_dirty{other.m_dirty}
+	{
+		for (RamPage* page : m_pages)
+			page->refs.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	Ram& operator=(const Ram& other)
+	{
+		for (int i = 0; i < pageCount; i++)
+		{
+			if (m_pages[i] == other.m_pages[i]) 
+				continue;
+
+			other.m_pages[i]->refs.fetch_add(1, std::memory_order_relaxed);
+			unref(m_pages[i]);
+			m_pages[i] = other.m_pages[i];
+		}
+		m_dirty = other.m_dirty;
+
+		return *this;
+	}
+
+	~Ram()
+	{
+		for (RamPage* page : m_pages)
+			unref(page);
+	}
+
+	// Addresses wrap around the 4KB like the 12 bit address bus would
+	uint8_t read(uint16_t addr) const
+	{
+		addr &= size - 1;
+		return m_pages[addr / RamPage::size]->data[addr % RamPage::size];
+	}
+
+	void write(uint16_t addr, uint8_t value)
+	{
+		ownPage(addr)->data[addr % RamPage::size] = value;
+	}
+
+	uint16_t takeDirty()
+	{
+		const uint16_t dirty = m_dirty;
+		m_dirty = 0;
+		return dirty;
+	}
+
+	uint64_t pageHash(int page) const {return Hash::fnv1a(m_pages[page]->data.data(), RamPage::size);}
+
+	uint64_t hash() const
+	{
+		uint64_t hash = Hash::fnvOffset;
+		for (const RamPage* page : m_pages)
+			hash = Hash::fnv1a(page->data.data(), page->data.size(), hash);
+
+		return hash;
+	}
+
+	// Copies a block into the ram, anything past the end of the ram is dropped
+	void load(uint16_t addr, const uint8_t* src, std::size_t len)
+	{
+		if (addr >= size) return;
+		len = std::min<std::size_t>(len, size - addr);
+
+		while (len > 0)
+		{
+			const std::size_t offset = addr % RamPage::size;
+			const std::size_t count = std::min<std::size_t>(len, RamPage::size - offset);
+
+			memcpy(&ownPage(addr)->data[offset], src, count);
+
+			addr += count;
+			src += count;
+			len -= count;
+		}
+	}
+};
+
+// Things a rom did that would have broken the original machine. The 
+// interpreter keeps going, the fault bits stay set until clearFaults()
+namespace Fault
+{
+	constexpr uint8_t stackOverflow = 1 << 0;		// 2NNN with 12 addresses on the stack
+	constexpr uint8_t stackUnderflow = 1 << 1;		// 00EE with an empty stack
+	constexpr uint8_t ramOutOfBounds = 1 << 2;		// Access past 0xFFF, wraps around
+	constexpr uint8_t badKey = 1 << 3;				// EX9E/EXA1 with Vx > 0xF
+	constexpr int count = 4;
+
+	const char* names[count] = {"stack_overflow", "stack_underflow", "ram_out_of_bounds", "bad_key"};
+
+	// Like "stack_overflow, bad_key"
+	std::string describe(uint8_t faults)
+	{
+		if (!faults) return "none";
+
+		std::string text;
+		for (int i = 0; i < count; i++)
+			if ((faults >> i) & 1)
+				text += (text.empty() ? "" : ", ") + std::string{names[i]};
+
+		return text;
+	}
+}
+
+class Chip8;
+
+// Hooks that run around every instruction. Tools derive from this and hide the
+// functions they need, the defaults compile away to nothing
+struct FrameHooks
+{
+	// Runs before the instruction, returning false ends the frame early
+	bool beforeCycle(Chip8&) {return true;}
+
+	// Data accesses of the instruction (not the opcode fetch)
+	void onRead(uint16_t, uint8_t) {}
+	void onWrite(uint16_t, uint8_t) {}
+};
+
+class alignas(64) Chip8
 {
 private:
 	const static int m_scrWidth = 64;
 	const static int m_scrHeight = 32;
-	std::array<uint8_t, 5*16> m_font {
+
+	// What reset() goes back to. Built at startup so its pages come from the
+	// heap and not from some worker's arena, and never freed so they dont 
+	// outlive the page cache at exit
+	static const Chip8* const m_pristine;
+	static constexpr uint16_t m_fontAddr = 0x050;
+	static constexpr std::array<uint8_t, 5*16> m_font {
 		0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
 		0x20, 0x60, 0x20, 0x20, 0x70, // 1
 		0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
@@ -76,37 +607,144 @@ private:
 		0xF0, 0x80, 0xF0, 0x80, 0x80  // F
 	};
 
+	// Everything below is plain data (the ram only holds page pointers) so a 
+	// machine can be forked with a single flat copy
 	bool m_draw{true};									// Refresh the screen when true
-	std::array<bool, m_scrWidth*m_scrHeight> m_display{};// Emulate the original display
-	std::array<uint8_t, 4096>* m_ram = new std::array<uint8_t, 4096>{};
+	std::array<uint64_t, m_scrHeight> m_display{};		// One bit per pixel, leftmost pixel is the MSB
+	Ram m_ram{};
 	std::array<uint8_t, 16> m_V{};						// Data registers
-	std::array<uint32_t, 12> m_stack{};					// Stack memory for up to 12 addresses
-	uint32_t* m_pStack{&m_stack[0]};					// Stack pointer
+	std::array<uint16_t, 12> m_stack{};					// Stack memory for up to 12 addresses
+	uint8_t m_SP{};										// Stack pointer (index into m_stack)
 	uint16_t m_opcode{};								// The current opcode
 	uint16_t m_PC{0x200};								// Program counter
 	uint16_t m_I{};										// Address register
 	uint8_t m_delayTimer{};								// Decrements at 60Hz while > 0
 	uint8_t m_soundTimer{};								// Decrements and beeps while > 0
+	uint8_t m_waitKey{0xFF};							// Key latched by FX0A, 0xFF for none
+	bool m_waitKeyPressed{false};						// FX0A saw a key go down
+	uint32_t m_rng{static_cast<uint32_t>(Random::get(1, INT32_MAX))};	// xorshift32 state
+	uint64_t m_cycles{};								// Instructions executed so far
+	uint8_t m_faults{};									// Fault bits, see Fault
+	uint16_t m_faultPC{};								// Instruction that raised the first fault
+	uint8_t m_firstFault{};								// Fault bit of the first fault
+
+	void fault(uint8_t kind)
+	{
+		if (!m_faults)
+		{
+			m_faultPC = m_PC - 2;
+			m_firstFault = kind;
+		}
+		m_faults |= kind;
+	}
+
+	void checkAddr(unsigned addr)
+	{
+		if (addr >= Ram::size)
+			fault(Fault::ramOutOfBounds);
+	}
+
+	// Keys past F dont exist, they read as not pressed
+	bool keyDown(uint8_t key)
+	{
+		if (key < keypad.size())
+			return keypad[key];
+
+		fault(Fault::badKey);
+		return false;
+	}
+
+	// Data accesses go through these so the hooks can see them
+	template <typename Hooks>
+	uint8_t load(Hooks& hooks, unsigned addr)
+	{
+		checkAddr(addr);
+		const uint8_t value = m_ram.read(addr);
+		hooks.onRead(addr & (Ram::size - 1), value);
+		return value;
+	}
+
+	template <typename Hooks>
+	void store(Hooks& hooks, unsigned addr, uint8_t value)
+	{
+		checkAddr(addr);
+		hooks.onWrite(addr & (Ram::size - 1), value);
+		m_ram.write(addr, value);
+	}
+
+	uint8_t nextRandom()
+	{
+		m_rng ^= m_rng << 13;
+		m_rng ^= m_rng >> 17;
+		m_rng ^= m_rng << 5;
+		return m_rng >> 24;
+	}
 
 public:
 	std::array<bool, 16> keypad{};						// The keys are the hex chars
 
 	Chip8()
 	{
-		memcpy(&(*m_ram)[0x050], m_font.data(), m_font.size());
+		m_ram.load(m_fontAddr, m_font.data(), m_font.size());
 	}
 
-	~Chip8()
-	{
-		delete m_ram;
-	}
-	
-	Chip8(Chip8&) = delete;
-	Chip8(Chip8&&) = delete;
+	// Forking a machine is a plain copy, the ram pages are shared until written
+	Chip8(const Chip8&) = default;
+	Chip8& operator=(const Chip8&) = default;
+
+	// Makes the random number generator (CXNN) reproducible
+	void seed(uint32_t seed) {m_rng = seed ? seed : 1;}
 
 	int getWidth() const {return m_scrWidth;}
 	int getHeight() const {return m_scrHeight;}
 	bool isBeeping() const {return m_soundTimer > 0;}
+	bool getPixel(int x, int y) const {return (m_display[y] >> (m_scrWidth - 1 - x)) & 1;}
+	uint64_t getCycles() const {return m_cycles;}
+	uint16_t getPC() const {return m_PC;}
+	uint16_t getI() const {return m_I;}
+	uint8_t getV(int reg) const {return m_V[reg];}
+	int getSP() const {return m_SP;}
+	uint16_t getStack(int level) const {return m_stack[level];}
+	uint8_t peek(uint16_t addr) const {return m_ram.read(addr);}
+	uint8_t getDelayTimer() const {return m_delayTimer;}
+	uint8_t getSoundTimer() const {return m_soundTimer;}
+	uint16_t getKeyLatch() const {return m_waitKey | m_waitKeyPressed << 8;}
+	uint8_t getFaults() const {return m_faults;}
+	uint16_t getFaultPC() const {return m_faultPC;}
+	uint8_t getFirstFault() const {return m_faults ? m_firstFault : 0;}
+	void clearFaults() {m_faults = 0;}
+
+	// The keypad as a bit mask, bit N is key N
+	uint16_t getKeys() const
+	{
+		uint16_t mask = 0;
+		for (std::size_t i = 0; i < keypad.size(); i++)
+			mask |= keypad[i] << i;
+
+		return mask;
+	}
+
+	void setKeys(uint16_t mask)
+	{
+		for (std::size_t i = 0; i < keypad.size(); i++)
+			keypad[i] = (mask >> i) & 1;
+	}
+
+	// Cheap fingerprints of the machine state for regression checks
+	uint64_t displayHash() const {return Hash::fnv1a(m_display.data(), sizeof(m_display));}
+	uint64_t ramHash() const {return m_ram.hash();}
+	uint64_t ramPageHash(int page) const {return m_ram.pageHash(page);}
+	uint16_t takeDirtyPages() {return m_ram.takeDirty();}
+	uint64_t registersHash() const
+	{
+		uint64_t hash = Hash::fnv1a(m_V.data(), m_V.size());
+		hash = Hash::fnv1a(m_stack.data(), sizeof(m_stack), hash);
+		hash = Hash::fnv1a(&m_SP, sizeof(m_SP), hash);
+		hash = Hash::fnv1a(&m_PC, sizeof(m_PC), hash);
+		hash = Hash::fnv1a(&m_I, sizeof(m_I), hash);
+		hash = Hash::fnv1a(&m_delayTimer, sizeof(m_delayTimer), hash);
+		return Hash::fnv1a(&m_soundTimer, sizeof(m_soundTimer), hash);
+	}
 	bool refreshScreen() 
 	{
 		if (m_draw)
@@ -136,19 +774,36 @@ public:
 		rect.w = 1 * Config::scaleFac;
 		rect.h = 1 * Config::scaleFac;
 
-		for (std::size_t i = 0; i < m_display.size(); i++)
+		for (int y = 0; y < m_scrHeight; y++)
 		{
-			if (m_display[i])
+			for (int x = 0; x < m_scrWidth; x++)
 			{
-				rect.x = (i % m_scrWidth) * Config::scaleFac;
-				rect.y = (i / m_scrWidth) * Config::scaleFac;
-				SDL_FillRect(surf, &rect, Config::fgColor);
+				if (getPixel(x, y))
+				{
+					rect.x = x * Config::scaleFac;
+					rect.y = y * Config::scaleFac;
+					SDL_FillRect(surf, &rect, Config::fgColor);
+				}
 			}
 		}
 	}
 	
-	// Copies the program binaries from the file to the ram at address 0x200
-	bool loadProgram(char* fileName)
+	// Puts the machine back in its power on state. The keypad and the random
+	// number generator are kept
+	void reset()
+	{
+		// Copying the pristine machine only swaps the ram page references
+		const uint32_t rng = m_rng;
+		const std::array<bool, 16> keys = keypad;
+
+		*this = *m_pristine;
+
+		m_rng = rng;
+		keypad = keys;
+	}
+
+	// Reads the program binaries from the file
+	static bool readProgram(const char* fileName, std::vector<uint8_t>& buffer)
 	{
 		if (!fileName)
 		{
@@ -165,29 +820,64 @@ public:
 
 		std::streamsize fileSize = file.tellg();
     	file.seekg(0, std::ios::beg);
+
+		if (fileSize > Ram::size - 0x200)
+		{
+			SDL_Log("The rom is %lld bytes but only %d fit in the ram\n", static_cast<long long>(fileSize), Ram::size - 0x200);
+			return false;
+		}
 		
-    	std::vector<uint8_t> buffer(fileSize);
+    	buffer.resize(fileSize);
     	if (!file.read(reinterpret_cast<char*>(buffer.data()), fileSize)) 
 		{
         	SDL_Log("Failed to read file\n");
         	return false;
     	}
 
-		memcpy(&(*m_ram)[0x200], buffer.data(), buffer.size());
+		return true;
+	}
+
+	// Copies the program into the ram at address 0x200 without touching the 
+	// rest of the machine
+	void patchProgram(const std::vector<uint8_t>& program)
+	{
+		m_ram.load(0x200, program.data(), program.size());
+	}
 
+	// Resets the machine and boots the program
+	void loadProgram(const std::vector<uint8_t>& program)
+	{
+		reset();
+		patchProgram(program);
 		m_PC = 0x200;
-		
-		file.close();
+	}
+
+	// Resets the machine and boots the program from the file
+	bool loadProgram(const char* fileName)
+	{
+		std::vector<uint8_t> buffer;
+		if (!readProgram(fileName, buffer))
+			return false;
 
+		loadProgram(buffer);
 		return true;
 	}
 	
 	// Emulates one cycle
 	void emulateCycle()
+	{
+		FrameHooks hooks;
+		emulateCycle(hooks);
+	}
+
+	template <typename Hooks>
+	void emulateCycle(Hooks& hooks)
 	{
 		// Fetch opcode and increment PC by 2
-		m_opcode = ((*m_ram)[m_PC] << 8) | ((*m_ram)[m_PC + 1]);
+		m_opcode = (m_ram.read(m_PC) << 8) | m_ram.read(m_PC + 1);
 		m_PC += 2;
+		m_cycles++;
+		checkAddr(m_PC - 1);
 
 		bool carry = false;
 		uint16_t NNN = m_opcode & 0x0FFF;
@@ -204,7 +894,7 @@ public:
 			// Clear the screen
 			if (NN == 0xE0)
 			{
-				memset(&m_display[0], 0, m_display.size());
+				m_display.fill(0);
 				m_draw = true;
 
 				DEBUG_LOG("Cleared the screen");
@@ -213,8 +903,15 @@ public:
 			// Return to subroutine NN
 			if (NN == 0xEE)
 			{
+				if (m_SP == 0)
+				{
+					fault(Fault::stackUnderflow);
+					SDL_Log("Tried returning with an empty stack at PC=0x%04X\n", m_PC - 2);
+					break;
+				}
+
 				// CAN I PUT MY BALLS IN YOUR JAWS, "--"?
-				m_PC = *--m_pStack;
+				m_PC = m_stack[--m_SP];
 
 				DEBUG_LOG("Returned to subroutine 0x%04X", m_PC);
 				break;
@@ -226,7 +923,7 @@ public:
 				// just the empty ram
 
 				SDL_Log("Tried executing opcode 0x0000 but this might be just the empty ram\n");
-				SDL_Log("\tPC=0x%04x *pStack=%X \n", m_PC, *m_pStack);
+				SDL_Log("\tPC=0x%04x SP=%X \n", m_PC, m_SP);
 				
 				break;
 			}
@@ -243,10 +940,17 @@ public:
 
 		// Calls subroutine at address NNN
 		case 0x2:
-			*m_pStack++ = m_PC;
-			m_PC = NNN;
-
-			DEBUG_LOG("Called subroutine at address 0x%03X", m_PC);
+			if (m_SP >= m_stack.size())
+			{
+				fault(Fault::stackOverflow);
+				SDL_Log("Stack overflow calling 0x%03X at PC=0x%04X\n", NNN, m_PC - 2);
+				break;
+			}
+
+			m_stack[m_SP++] = m_PC;
+			m_PC = NNN;
+
+			DEBUG_LOG("Called subroutine at address 0x%03X", m_PC);
 			break;
 		
 		// Skip the next instruction if Vx == NN
@@ -409,7 +1113,7 @@ public:
 		
 		// Random number generator
 		case 0xC:
-			m_V[X] = Random::get(0, 255) & NN;
+			m_V[X] = nextRandom() & NN;
 
 			DEBUG_LOG("Generating a random number for V[%01X] and then do bitwise AND with 0x%02X", X, NN);
 			break;
@@ -418,36 +1122,23 @@ public:
 		case 0xD:
 		{
 			// this shit was annoying af
-			uint8_t xCoord = m_V[X] % m_scrWidth;
+			const uint8_t xCoord = m_V[X] % m_scrWidth;
 			uint8_t yCoord = m_V[Y] % m_scrHeight;
-			uint8_t origin = xCoord;
 			m_V[0xF] = 0;
 
-			constexpr uint8_t spriteWidth = 8;
-
-			// For each row(basically drawing on Y axis)
-			for (int i = 0; i < N; i++)
+			// For each row(basically drawing on Y axis), stopping at the 
+			// bottom edge of the screen
+			for (int i = 0; i < N && yCoord < m_scrHeight; i++, yCoord++)
 			{
-				const uint8_t sprite = (*m_ram)[m_I+i];
-				xCoord = origin;
+				// Line the sprite up with the row, whatever goes past the 
+				// right edge of the screen gets shifted out
+				const uint64_t line = (static_cast<uint64_t>(load(hooks, m_I+i)) << 56) >> xCoord;
+				uint64_t& row = m_display[yCoord];
 
-				for (int j = spriteWidth - 1; j >= 0; j--)
-				{
-					bool& pixel = m_display[xCoord+(m_scrWidth*yCoord)];
-					const bool spriteBit = (1 << j) & sprite;
-
-					if (spriteBit && pixel)
-					{
-						m_V[0xF] = true;
-					}
+				if (row & line)
+					m_V[0xF] = true;
 
-					pixel ^= spriteBit;
-
-					// If it hit the right edge of the screen
-					if (++xCoord >= m_scrWidth) break;
-				}
-				// If it hit the bottom edge of the screen
-				if (++yCoord >= m_scrHeight) break;
+				row ^= line;
 			}
 			
 			m_draw = true;
@@ -461,7 +1152,7 @@ public:
 			// If the key is pressed
 			if (NN == 0x9E)
 			{
-				if (keypad[m_V[X]])
+				if (keyDown(m_V[X]))
 					m_PC += 2;
 				
 				DEBUG_LOG("Skipping if the key pressed is %01X", m_V[X]);
@@ -471,7 +1162,7 @@ public:
 			// If the key is not pressed
 			if (NN == 0xA1)
 			{
-				if (!keypad[m_V[X]])
+				if (!keyDown(m_V[X]))
 					m_PC += 2;
 				
 				DEBUG_LOG("Skipping if the key pressed is not %01X", m_V[X]);
@@ -496,30 +1187,27 @@ public:
 			{
 				DEBUG_LOG("Await for keypresses and then store it in V[%01X]", X);
 				
-				static bool keyPressed = false;
 				// Since the keys go up to 0x0F, 0xFF can be used like null
-				static uint8_t key = 0xFF;
-
-				for (uint8_t i = 0; key == 0xFF && i < keypad.size(); i++) 
+				for (uint8_t i = 0; m_waitKey == 0xFF && i < keypad.size(); i++) 
                     if (keypad[i]) 
 					{
-						keyPressed = true;
-                        key = i;
+						m_waitKeyPressed = true;
+                        m_waitKey = i;
                         break;
                     }
 				
 				// If no key has been pressed yet or it is held, keep getting 
 				// the current opcode
-				if (!keyPressed || keypad[key])
+				if (!m_waitKeyPressed || keypad[m_waitKey])
 				{
 					m_PC -= 2;
 				}
 				else
 				{
-					m_V[X] = key;
+					m_V[X] = m_waitKey;
 
-					keyPressed = false;
-					key = 0xFF;
+					m_waitKeyPressed = false;
+					m_waitKey = 0xFF;
 				}
 				
 				break;
@@ -544,19 +1232,19 @@ public:
 
 			// Sets I to the sprite location for the char in Vx
 			case 0x29:
-				m_I = m_V[X] * 5;
-				DEBUG_LOG("I = V[%01X] * 5 == 0x%01X", X, m_V[X]);
+				m_I = m_fontAddr + m_V[X] * 5;
+				DEBUG_LOG("I = 0x050 + V[%01X] * 5 == 0x%03X", X, m_I);
 				break;
 
 			// Binary to decimal conversion
 			case 0x33:
 			{
 				uint8_t BCD = m_V[X];
-				(*m_ram)[m_I+2] = BCD % 10;
+				store(hooks, m_I+2, BCD % 10);
 				BCD /= 10;
-				(*m_ram)[m_I+1] = BCD % 10;
+				store(hooks, m_I+1, BCD % 10);
 				BCD /= 10;
-				(*m_ram)[m_I] = BCD;
+				store(hooks, m_I, BCD);
 
 				DEBUG_LOG("something something BCD");
 				break;
@@ -569,7 +1257,7 @@ public:
 
 				for (uint8_t i = 0; i <= X; i++)
 				{
-					(*m_ram)[m_I++] = m_V[i];
+					store(hooks, m_I++, m_V[i]);
 					DEBUG_LOG("\tV[%01X] = %01X", i, X);
 				}
 
@@ -583,7 +1271,7 @@ public:
 
 				for (uint8_t i = 0; i <= X; i++)
 				{
-					m_V[i] = (*m_ram)[m_I++];
+					m_V[i] = load(hooks, m_I++);
 					DEBUG_LOG("\tV[%01X] = %01X", i, X);
 				}
 
@@ -597,6 +1285,236 @@ public:
 			break;
 		}
 	}
+
+	// A second interpreter that decodes through a table of handlers, one per 
+	// top nibble, instead of the big switch. It skips the logging and must 
+	// behave exactly like emulateCycle(), which the differential checker 
+	// (--diff) verifies
+	void emulateCycleTable()
+	{
+		using OpHandler = void (Chip8::*)(uint16_t);
+		static constexpr OpHandler ops[16] = {
+			&Chip8::opSystem, &Chip8::opJump, &Chip8::opCall, &Chip8::opSkipEqual,
+			&Chip8::opSkipNotEqual, &Chip8::opSkipRegsEqual, &Chip8::opSet, &Chip8::opAdd,
+			&Chip8::opAlu, &Chip8::opSkipRegsNotEqual, &Chip8::opSetI, &Chip8::opJumpV0,
+			&Chip8::opRandom, &Chip8::opDraw, &Chip8::opKeys, &Chip8::opMisc
+		};
+
+		m_opcode = (m_ram.read(m_PC) << 8) | m_ram.read(m_PC + 1);
+		m_PC += 2;
+		m_cycles++;
+		checkAddr(m_PC - 1);
+
+		(this->*ops[m_opcode >> 12])(m_opcode);
+	}
+
+private:
+	static uint8_t opX(uint16_t op) {return (op >> 8) & 0x0F;}
+	static uint8_t opY(uint16_t op) {return (op >> 4) & 0x0F;}
+
+	void opSystem(uint16_t op)
+	{
+		// Like the reference only the low byte is decoded
+		if ((op & 0xFF) == 0xE0)
+		{
+			m_display.fill(0);
+			m_draw = true;
+		}
+		else if ((op & 0xFF) == 0xEE)
+		{
+			if (m_SP == 0) fault(Fault::stackUnderflow);
+			else m_PC = m_stack[--m_SP];
+		}
+	}
+
+	void opJump(uint16_t op) {m_PC = op & 0x0FFF;}
+	void opCall(uint16_t op)
+	{
+		if (m_SP >= m_stack.size())
+		{
+			fault(Fault::stackOverflow);
+			return;
+		}
+
+		m_stack[m_SP++] = m_PC;
+		m_PC = op & 0x0FFF;
+	}
+
+	void opSkipEqual(uint16_t op) {m_PC += (m_V[opX(op)] == (op & 0xFF)) * 2;}
+	void opSkipNotEqual(uint16_t op) {m_PC += (m_V[opX(op)] != (op & 0xFF)) * 2;}
+	void opSkipRegsEqual(uint16_t op) {m_PC += ((op & 0xF) == 0 && m_V[opX(op)] == m_V[opY(op)]) * 2;}
+	void opSkipRegsNotEqual(uint16_t op) {m_PC += ((op & 0xF) == 0 && m_V[opX(op)] != m_V[opY(op)]) * 2;}
+	void opSet(uint16_t op) {m_V[opX(op)] = op & 0xFF;}
+	void opAdd(uint16_t op) {m_V[opX(op)] += op & 0xFF;}
+	void opSetI(uint16_t op) {m_I = op & 0x0FFF;}
+	void opJumpV0(uint16_t op) {m_PC = m_V[0] + (op & 0x0FFF);}
+	void opRandom(uint16_t op) {m_V[opX(op)] = nextRandom() & op;}
+
+	void opAlu(uint16_t op)
+	{
+		uint8_t& vx = m_V[opX(op)];
+		const uint8_t vy = m_V[opY(op)];
+		uint8_t flag;
+
+		switch (op & 0xF)
+		{
+		case 0x0: vx = vy; return;
+		case 0x1: vx |= vy; m_V[0xF] = 0; return;
+		case 0x2: vx &= vy; m_V[0xF] = 0; return;
+		case 0x3: vx ^= vy; m_V[0xF] = 0; return;
+		case 0x4: flag = vx + vy > 0xFF; vx += vy; break;
+		case 0x5: flag = vx >= vy; vx -= vy; break;
+		case 0x6: flag = vy & 1; vx = vy >> 1; break;
+		case 0x7: flag = vy >= vx; vx = vy - vx; break;
+		case 0xE: flag = vy >> 7; vx = vy << 1; break;
+		default: return;
+		}
+
+		// VF is written last so it wins when X is F
+		m_V[0xF] = flag;
+	}
+
+	void opDraw(uint16_t op)
+	{
+		const unsigned x = m_V[opX(op)] & (m_scrWidth - 1);
+		const unsigned y = m_V[opY(op)] & (m_scrHeight - 1);
+		const unsigned rows = std::min<unsigned>(op & 0xF, m_scrHeight - y);
+		uint64_t collision = 0;
+
+		if (rows > 0) checkAddr(m_I + rows - 1);
+		for (unsigned i = 0; i < rows; i++)
+		{
+			const uint64_t line = (static_cast<uint64_t>(m_ram.read(m_I + i)) << 56) >> x;
+			collision |= m_display[y + i] & line;
+			m_display[y + i] ^= line;
+		}
+
+		m_V[0xF] = collision != 0;
+		m_draw = true;
+	}
+
+	void opKeys(uint16_t op)
+	{
+		if ((op & 0xFF) == 0x9E) m_PC += keyDown(m_V[opX(op)]) * 2;
+		else if ((op & 0xFF) == 0xA1) m_PC += !keyDown(m_V[opX(op)]) * 2;
+	}
+
+	void opMisc(uint16_t op)
+	{
+		const uint8_t X = opX(op);
+
+		switch (op & 0xFF)
+		{
+		case 0x07: m_V[X] = m_delayTimer; break;
+		case 0x15: m_delayTimer = m_V[X]; break;
+		case 0x18: m_soundTimer = m_V[X]; break;
+		case 0x1E: m_I += m_V[X]; break;
+		case 0x29: m_I = m_fontAddr + m_V[X] * 5; break;
+		case 0x0A:
+			// Wait for a key to be pressed and released
+			if (m_waitKey == 0xFF)
+			{
+				for (uint8_t i = 0; i < keypad.size(); i++)
+					if (keypad[i]) 
+					{
+						m_waitKey = i;
+						m_waitKeyPressed = true;
+						break;
+					}
+			}
+
+			if (!m_waitKeyPressed || keypad[m_waitKey])
+			{
+				m_PC -= 2;
+				break;
+			}
+
+			m_V[X] = m_waitKey;
+			m_waitKey = 0xFF;
+			m_waitKeyPressed = false;
+			break;
+		case 0x33:
+			checkAddr(m_I + 2);
+			m_ram.write(m_I + 2, m_V[X] % 10);
+			m_ram.write(m_I + 1, m_V[X] / 10 % 10);
+			m_ram.write(m_I, m_V[X] / 100);
+			break;
+		case 0x55:
+			checkAddr(m_I + X);
+			for (unsigned i = 0; i <= X; i++)
+				m_ram.write(m_I++, m_V[i]);
+			break;
+		case 0x65:
+			checkAddr(m_I + X);
+			for (unsigned i = 0; i <= X; i++)
+				m_V[i] = m_ram.read(m_I++);
+			break;
+		}
+	}
+};
+
+const Chip8* const Chip8::m_pristine = new Chip8{};
+
+// Hands out cache aligned storage for forked machines and recycles it, so a 
+// search can fork thousands of machines per frame without hitting the heap.
+// A pool is not thread safe, every worker thread should own its own pool.
+// Given an arena the slots come from it instead of the heap
+class Chip8Pool
+{
+private:
+	struct alignas(Chip8) Slot
+	{
+		unsigned char bytes[sizeof(Chip8)];
+	};
+
+	static constexpr std::size_t m_chunkSize = 256;
+
+	std::vector<std::unique_ptr<Slot[]>> m_chunks;
+	std::vector<Slot*> m_free;
+	Arena* m_arena;
+
+	void grow()
+	{
+		Slot* chunk;
+		if (m_arena)
+		{
+			chunk = static_cast<Slot*>(m_arena->allocate(sizeof(Slot) * m_chunkSize, alignof(Slot)));
+			if (!chunk) throw std::bad_alloc{};
+		}
+		else
+		{
+			m_chunks.emplace_back(new Slot[m_chunkSize]);
+			chunk = m_chunks.back().get();
+		}
+
+		for (std::size_t i = 0; i < m_chunkSize; i++)
+			m_free.push_back(&chunk[i]);
+	}
+
+public:
+	explicit Chip8Pool(Arena* arena = nullptr) : m_arena{arena} {}
+	Chip8Pool(const Chip8Pool&) = delete;
+	Chip8Pool& operator=(const Chip8Pool&) = delete;
+
+	// Clones the machine, the clone is fully independent and can be handed to 
+	// another thread. It has to be released here, before the arena goes away
+	Chip8* fork(const Chip8& src)
+	{
+		if (m_free.empty())
+			grow();
+
+		Slot* slot = m_free.back();
+		m_free.pop_back();
+
+		return new (slot) Chip8(src);
+	}
+
+	// Every forked machine must be released before the pool is destroyed
+	void release(Chip8* c8)
+	{
+		c8->~Chip8();
+		m_free.push_back(reinterpret_cast<Slot*>(c8));
+	}
 };
 
 // Drawing informational UI function
@@ -643,192 +1561,2308 @@ void shootScreenshot(sdl_t& sdl)
     SDL_Log("Saved screenshot to \"%s\"\n", ssPath);
 }
 
-// Main loop function
-void loop(sdl_t& sdl, Chip8& chip8)
+// Writes the assembly for the opcode into out
+void disassemble(uint16_t opcode, char* out, std::size_t size)
 {
-	chip8.loadProgram(Config::romPath);
-	SDL_Surface* chip8Surf = SDL_CreateRGBSurface(0, 
-							chip8.getWidth()*Config::scaleFac,
-							chip8.getHeight()*Config::scaleFac, 32, 0, 0, 0, 0);
-
-	SDL_FillRect(chip8Surf, 0, Config::bgColor);
+	const unsigned NNN = opcode & 0x0FFF;
+	const unsigned NN = opcode & 0x00FF;
+	const unsigned N = opcode & 0x000F;
+	const unsigned X = (opcode >> 8) & 0x0F;
+	const unsigned Y = (opcode >> 4) & 0x0F;
+
+	static const char* aluOps[16] = {
+		"LD", "OR", "AND", "XOR", "ADD", "SUB", "SHR", "SUBN", 
+		nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, "SHL", nullptr
+	};
 
-	bool running = true;
-	while (running)
+	switch (opcode >> 12)
 	{
-		const double startFrame = SDL_GetPerformanceCounter();
-		bool screenshot = false;
-
-		// Update the window surface
-		SDL_Surface* winSurf = SDL_GetWindowSurface(sdl.window);
-		
-		SDL_Event ev;
-		while (SDL_PollEvent(&ev))
+	case 0x0:
+		if (opcode == 0x00E0) snprintf(out, size, "CLS");
+		else if (opcode == 0x00EE) snprintf(out, size, "RET");
+		else snprintf(out, size, "SYS 0x%03X", NNN);
+		return;
+	case 0x1: snprintf(out, size, "JP 0x%03X", NNN); return;
+	case 0x2: snprintf(out, size, "CALL 0x%03X", NNN); return;
+	case 0x3: snprintf(out, size, "SE V%X, 0x%02X", X, NN); return;
+	case 0x4: snprintf(out, size, "SNE V%X, 0x%02X", X, NN); return;
+	case 0x5: if (N == 0) {snprintf(out, size, "SE V%X, V%X", X, Y); return;} break;
+	case 0x6: snprintf(out, size, "LD V%X, 0x%02X", X, NN); return;
+	case 0x7: snprintf(out, size, "ADD V%X, 0x%02X", X, NN); return;
+	case 0x8: if (aluOps[N]) {snprintf(out, size, "%s V%X, V%X", aluOps[N], X, Y); return;} break;
+	case 0x9: if (N == 0) {snprintf(out, size, "SNE V%X, V%X", X, Y); return;} break;
+	case 0xA: snprintf(out, size, "LD I, 0x%03X", NNN); return;
+	case 0xB: snprintf(out, size, "JP V0, 0x%03X", NNN); return;
+	case 0xC: snprintf(out, size, "RND V%X, 0x%02X", X, NN); return;
+	case 0xD: snprintf(out, size, "DRW V%X, V%X, %u", X, Y, N); return;
+	case 0xE:
+		if (NN == 0x9E) {snprintf(out, size, "SKP V%X", X); return;}
+		if (NN == 0xA1) {snprintf(out, size, "SKNP V%X", X); return;}
+		break;
+	case 0xF:
+		switch (NN)
 		{
-			switch (ev.type)
-			{
-			case SDL_QUIT:
-				running = false;
-				break;
-
-			case SDL_KEYDOWN:
-                switch (ev.key.keysym.sym) 
-				{
-				case SDLK_ESCAPE:
-					running = false;
-					break;
-				
-				case SDLK_PERIOD:
-					if (Global::clockSpeed + 100 < Config::normalClockSpeed * Config::maxClockSpeedMp)
-						Global::clockSpeed += 100;
-					break;
+		case 0x07: snprintf(out, size, "LD V%X, DT", X); return;
+		case 0x0A: snprintf(out, size, "LD V%X, K", X); return;
+		case 0x15: snprintf(out, size, "LD DT, V%X", X); return;
+		case 0x18: snprintf(out, size, "LD ST, V%X", X); return;
+		case 0x1E: snprintf(out, size, "ADD I, V%X", X); return;
+		case 0x29: snprintf(out, size, "LD F, V%X", X); return;
+		case 0x33: snprintf(out, size, "LD B, V%X", X); return;
+		case 0x55: snprintf(out, size, "LD [I], V%X", X); return;
+		case 0x65: snprintf(out, size, "LD V%X, [I]", X); return;
+		}
+		break;
+	}
 
-				case SDLK_COMMA:
-					if (Global::clockSpeed - 100 > Config::normalClockSpeed * Config::minClockSpeedMp)
-						Global::clockSpeed -= 100;
-					break;
-				
-				case SDLK_0:
-					Global::clockSpeed = Config::normalClockSpeed;
-					break;
-				
-				case SDLK_SPACE:
-				if (Global::clockSpeed == 0)
-				{
-					Global::clockSpeed = Config::normalClockSpeed;
-					printf("+---Unpaused---+\n");
-					break;
-				}
-					Global::clockSpeed = 0;
-					printf("+---Paused---+\n");
-					break;
-				
-				case SDLK_BACKQUOTE:
-					screenshot = true;
-					break;
-				
-				// Map qwerty keys to CHIP8 keypad
-				case SDLK_1: chip8.keypad[0x1] = true; break;
-				case SDLK_2: chip8.keypad[0x2] = true; break;
-				case SDLK_3: chip8.keypad[0x3] = true; break;
-				case SDLK_4: chip8.keypad[0xC] = true; break;
+	snprintf(out, size, "DW 0x%04X", opcode);
+}
 
-				case SDLK_q: chip8.keypad[0x4] = true; break;
-				case SDLK_w: chip8.keypad[0x5] = true; break;
-				case SDLK_e: chip8.keypad[0x6] = true; break;
-				case SDLK_r: chip8.keypad[0xD] = true; break;
+// Samples the guest PC every few instructions and rebuilds the guest call 
+// stack from the return addresses the 2NNN calls pushed
+class Profiler : public FrameHooks
+{
+private:
+	int m_interval;
+	int m_countdown;
+	uint64_t m_samples{};
+	std::array<uint64_t, Ram::size> m_hits{};				// Samples per address
+	std::unordered_map<std::string, uint64_t> m_stacks{};	// Samples per folded stack
 
-				case SDLK_a: chip8.keypad[0x7] = true; break;
-				case SDLK_s: chip8.keypad[0x8] = true; break;
-				case SDLK_d: chip8.keypad[0x9] = true; break;
-				case SDLK_f: chip8.keypad[0xE] = true; break;
+	void sample(const Chip8& chip8)
+	{
+		m_samples++;
+		m_hits[chip8.getPC() & (Ram::size - 1)]++;
+
+		// The entry of every routine on the stack is the target of the call 
+		// that sits right before its return address
+		std::string stack = "rom";
+		char frame[16];
+		for (int level = 0; level < chip8.getSP(); level++)
+		{
+			const uint16_t call = chip8.getStack(level) - 2;
+			const uint16_t opcode = (chip8.peek(call) << 8) | chip8.peek(call + 1);
+
+			if ((opcode & 0xF000) == 0x2000)
+				snprintf(frame, sizeof(frame), ";sub_%03X", opcode & 0x0FFF);
+			else
+				snprintf(frame, sizeof(frame), ";from_%03X", call);
+			stack += frame;
+		}
 
-				case SDLK_z: chip8.keypad[0xA] = true; break;
-				case SDLK_x: chip8.keypad[0x0] = true; break;
-				case SDLK_c: chip8.keypad[0xB] = true; break;
-				case SDLK_v: chip8.keypad[0xF] = true; break;
-				
-				default: break;
-                }
+		m_stacks[stack]++;
+	}
 
-                break; 
+public:
+	Profiler(int interval) : m_interval{std::max(interval, 1)}, m_countdown{m_interval} {}
 
-            case SDL_KEYUP:
-                switch (ev.key.keysym.sym) 
-				{
-				// Map qwerty keys to CHIP8 keypad
-				case SDLK_1: chip8.keypad[0x1] = false; break;
-				case SDLK_2: chip8.keypad[0x2] = false; break;
-				case SDLK_3: chip8.keypad[0x3] = false; break;
-				case SDLK_4: chip8.keypad[0xC] = false; break;
+	// Called before every instruction, keep it small
+	bool beforeCycle(const Chip8& chip8)
+	{
+		if (--m_countdown > 0) return true;
 
-				case SDLK_q: chip8.keypad[0x4] = false; break;
-				case SDLK_w: chip8.keypad[0x5] = false; break;
-				case SDLK_e: chip8.keypad[0x6] = false; break;
-				case SDLK_r: chip8.keypad[0xD] = false; break;
+		// Jitter the interval so loops of the same length dont alias with it
+		m_countdown = m_interval / 2 + Random::get(1, m_interval);
+		sample(chip8);
+		return true;
+	}
 
-				case SDLK_a: chip8.keypad[0x7] = false; break;
-				case SDLK_s: chip8.keypad[0x8] = false; break;
-				case SDLK_d: chip8.keypad[0x9] = false; break;
-				case SDLK_f: chip8.keypad[0xE] = false; break;
+	// Folded stacks, one per line, ready for flamegraph.pl or speedscope
+	bool writeFolded(const char* path) const
+	{
+		FILE* file = fopen(path, "w");
+		if (!file) return false;
 
-				case SDLK_z: chip8.keypad[0xA] = false; break;
-				case SDLK_x: chip8.keypad[0x0] = false; break;
-				case SDLK_c: chip8.keypad[0xB] = false; break;
-				case SDLK_v: chip8.keypad[0xF] = false; break;
+		for (const auto& [stack, count] : m_stacks)
+			fprintf(file, "%s %llu\n", stack.c_str(), static_cast<unsigned long long>(count));
 
-				default: break;
-            	}
+		fclose(file);
+		return true;
+	}
 
-                break;
-			}
-		}
+	// Disassembly of every sampled address with its share of the samples and 
+	// the estimated amount of instructions spent there
+	bool writeListing(const char* path, const Chip8& chip8) const
+	{
+		FILE* file = fopen(path, "w");
+		if (!file) return false;
 
-		bool screenRefreshed = false;
+		fprintf(file, "%llu samples, one every ~%d instructions\n\n", 
+				static_cast<unsigned long long>(m_samples), m_interval);
+		fprintf(file, " addr  op    instruction          cycles      %%\n");
 
-		// Emulate instructions at a speed of 60hz
-		for (int i = 0; i < Global::clockSpeed / 60; i++)
+		int last = -2;
+		char text[32];
+		for (int addr = 0; addr < Ram::size; addr++)
 		{
-			// Emulate a cycle
-			chip8.emulateCycle();
+			if (!m_hits[addr]) continue;
+			if (addr != last + 2) fprintf(file, "   ...\n");
+			last = addr;
 
-			// Break if the screen needs to be redrawn
-			if (chip8.refreshScreen())
-			{
-				// Looks like a bit of a workaround but it looks nicer imo
-				screenRefreshed = true;
-				break;
-			}
+			const uint16_t opcode = (chip8.peek(addr) << 8) | chip8.peek(addr + 1);
+			const double share = 100.0 * m_hits[addr] / m_samples;
+			disassemble(opcode, text, sizeof(text));
+
+			fprintf(file, "0x%03X  %04X  %-18s %8llu  %5.1f%% %.*s\n", addr, opcode, text, 
+					static_cast<unsigned long long>(m_hits[addr] * m_interval), share,
+					static_cast<int>(share / 2), "##################################################");
 		}
 
-		const double endFrame = SDL_GetPerformanceCounter();
+		fclose(file);
+		return true;
+	}
+};
 
-		// Get the time elapsed since the previous frame and delay it by 60hz/s
-		const double timeElapsed = (endFrame - startFrame) * 1000.0 / SDL_GetPerformanceFrequency();
-		SDL_Delay(16.67f > timeElapsed ? 16.67f - timeElapsed : 0);
+// Interactive debugger driven by commands typed into the console next to the
+// window. Breakpoints and watchpoints are kept in per address bitmaps so an
+// idle debugger only costs a bit test per instruction
+class Debugger : public FrameHooks
+{
+private:
+	using Bitmap = std::array<uint64_t, Ram::size / 64>;
 
-		// Redraw the chip 8 screen
-		if (screenRefreshed)
-			chip8.drawDisplay(chip8Surf);
-		
-		// This uses a separate surface for the chip8 display so it can be put 
-		// anywhere on the window. Might reuse in case I want to add UI
-		SDL_Rect chip8DisplayRect;
-		chip8DisplayRect.x = (winSurf->w - chip8.getWidth() * Config::scaleFac)/2;
-		chip8DisplayRect.y = (winSurf->h - chip8.getHeight() * Config::scaleFac)/2;
-		chip8DisplayRect.w = chip8.getWidth() * Config::scaleFac;
-		chip8DisplayRect.h = chip8.getHeight() * Config::scaleFac;
+	struct Breakpoint
+	{
+		uint16_t addr;
+		int reg;			// 0x0-0xF for Vx, 0x10 for I, -1 when unconditional
+		std::string op;
+		unsigned value;
+	};
 
-		SDL_BlitScaled(chip8Surf, NULL, winSurf, &chip8DisplayRect);
+	Bitmap m_breakBits{};
+	Bitmap m_readWatch{};
+	Bitmap m_writeWatch{};
+	std::vector<Breakpoint> m_breakpoints{};
+
+	bool m_paused = true;
+	bool m_slowPath = false;		// Something below needs checking this cycle
+	bool m_skipBreak = false;		// Dont stop on the breakpoint we resume from
+	int m_steps = -1;				// Instructions left to step, -1 when running
+	int m_overSP = -1;				// Step over target, -1 when not stepping over
+	uint16_t m_overPC{};
+	bool m_watchHit = false;
+	char m_watchText[64]{};
+	uint8_t m_faults{};				// Fault bits already reported
+
+	// Lines typed into the console, filled by the console thread. The thread
+	// outlives the debugger so it shares ownership of the queue
+	struct ConsoleInput
+	{
+		std::mutex mutex;
+		std::deque<std::string> lines;
+	};
+	std::shared_ptr<ConsoleInput> m_input = std::make_shared<ConsoleInput>();
 
-		chip8.updateTimers();
+	static bool testBit(const Bitmap& bits, uint16_t addr) {return (bits[addr >> 6] >> (addr & 63)) & 1;}
+	static void setBit(Bitmap& bits, uint16_t addr, bool on)
+	{
+		const uint64_t mask = 1ull << (addr & 63);
+		bits[addr >> 6] = on ? bits[addr >> 6] | mask : bits[addr >> 6] & ~mask;
+	}
+
+	static bool compare(unsigned lhs, const std::string& op, unsigned rhs)
+	{
+		if (op == "==") return lhs == rhs;
+		if (op == "!=") return lhs != rhs;
+		if (op == "<") return lhs < rhs;
+		if (op == ">") return lhs > rhs;
+		if (op == "<=") return lhs <= rhs;
+		if (op == ">=") return lhs >= rhs;
+		return false;
+	}
+
+	bool breakHit(const Chip8& chip8, uint16_t pc) const
+	{
+		for (const Breakpoint& bp : m_breakpoints)
+		{
+			if (bp.addr != pc) continue;
+			if (bp.reg < 0) return true;
+
+			const unsigned lhs = bp.reg == 0x10 ? chip8.getI() : chip8.getV(bp.reg);
+			if (compare(lhs, bp.op, bp.value)) return true;
+		}
+
+		return false;
+	}
+
+	void resume(bool skipBreak)
+	{
+		m_paused = false;
+		m_skipBreak = skipBreak;
+		m_slowPath = true;
+	}
+
+	bool stop(const Chip8& chip8, const char* reason)
+	{
+		m_paused = true;
+		m_steps = -1;
+		m_overSP = -1;
+		m_slowPath = false;
+
+		printf("%s\n", reason);
+		printRegisters(chip8);
+		printListing(chip8, chip8.getPC(), 1);
+		printf("(c8db) ");
+		fflush(stdout);
+		return false;
+	}
+
+	bool slowBeforeCycle(Chip8& chip8, uint16_t pc)
+	{
+		const bool skipBreak = m_skipBreak;
+		m_skipBreak = false;
+		m_slowPath = m_steps >= 0 || m_overSP >= 0;
+
+		if (m_watchHit)
+		{
+			m_watchHit = false;
+			return stop(chip8, m_watchText);
+		}
+
+		if (m_steps >= 0 && m_steps-- == 0)
+			return stop(chip8, "Stepped");
+
+		if (m_overSP >= 0 && pc == m_overPC && chip8.getSP() == m_overSP)
+			return stop(chip8, "Stepped over");
+
+		if (!skipBreak && testBit(m_breakBits, pc) && breakHit(chip8, pc))
+			return stop(chip8, "Breakpoint");
+
+		return true;
+	}
+
+	// Stops once for every new fault bit, a reset just clears the old ones
+	bool faultHit(Chip8& chip8)
+	{
+		const uint8_t added = chip8.getFaults() & ~m_faults;
+		m_faults = chip8.getFaults();
+		if (!added) return true;
+
+		char text[160];
+		snprintf(text, sizeof(text), "Fault: %s, first %s at 0x%03X", Fault::describe(added).c_str(), 
+				Fault::describe(chip8.getFirstFault()).c_str(), chip8.getFaultPC());
+		return stop(chip8, text);
+	}
+
+	// Only the first access of an instruction is reported
+	void watch(uint16_t addr, const char* kind, uint8_t value)
+	{
+		if (m_watchHit) return;
+
+		snprintf(m_watchText, sizeof(m_watchText), "Watchpoint: %s 0x%03X = 0x%02X", kind, addr, value);
+		m_watchHit = true;
+		m_slowPath = true;
+	}
+
+	void printRegisters(const Chip8& chip8) const
+	{
+		for (int i = 0; i < 16; i++)
+			printf("V%X=%02X%c", i, chip8.getV(i), i % 8 == 7 ? '\n' : ' ');
+		printf("PC=%03X I=%03X SP=%d", chip8.getPC(), chip8.getI(), chip8.getSP());
+		for (int i = 0; i < chip8.getSP(); i++)
+			printf(" %03X", chip8.getStack(i));
+		printf("\n");
+	}
+
+	void printListing(const Chip8& chip8, uint16_t addr, int count) const
+	{
+		char text[32];
+		for (int i = 0; i < count; i++, addr += 2)
+		{
+			const uint16_t opcode = (chip8.peek(addr) << 8) | chip8.peek(addr + 1);
+			disassemble(opcode, text, sizeof(text));
+			printf("%c%c 0x%03X  %04X  %s\n", addr == chip8.getPC() ? '>' : ' ', 
+					testBit(m_breakBits, addr & (Ram::size - 1)) ? '*' : ' ', addr, opcode, text);
+		}
+	}
+
+	void printHelp() const
+	{
+		printf("Addresses are hex, values are decimal or 0x hex\n"
+			   "  b <addr> [if <V0-VF|I> <==|!=|<|>|<=|>=> <value>]  set a breakpoint\n"
+			   "  d <addr>                    delete the breakpoints at addr\n"
+			   "  w <addr> [len] [r|w|rw]     watch ram accesses (default 1 byte, writes)\n"
+			   "  dw <addr> [len]             delete watchpoints\n"
+			   "  bl                          list breakpoints\n"
+			   "  c                           continue\n"
+			   "  s [count]                   step instructions\n"
+			   "  n                           step over a 2NNN call\n"
+			   "  p                           pause\n"
+			   "  r                           show registers\n"
+			   "  x <addr> [len]              dump ram\n"
+			   "  l [addr] [count]            disassemble\n");
+	}
+
+	void execute(Chip8& chip8, const std::string& line)
+	{
+		std::istringstream stream{line};
+		std::string cmd, arg1, arg2, arg3;
+		stream >> cmd >> arg1 >> arg2 >> arg3;
+
+		const unsigned addr = arg1.empty() ? chip8.getPC() : strtoul(arg1.c_str(), nullptr, 16) & (Ram::size - 1);
+
+		if (cmd == "b" && !arg1.empty())
+		{
+			Breakpoint bp{static_cast<uint16_t>(addr), -1, {}, 0};
+			if (arg2 == "if")
+			{
+				std::string op, value;
+				stream >> op >> value;
+
+				if (arg3 == "I" || arg3 == "i") bp.reg = 0x10;
+				else if (arg3.size() == 2 && (arg3[0] == 'V' || arg3[0] == 'v')) bp.reg = strtoul(&arg3[1], nullptr, 16);
+
+				const bool validOp = op == "==" || op == "!=" || op == "<" || op == ">" || op == "<=" || op == ">=";
+				if (bp.reg < 0 || bp.reg > 0x10 || value.empty() || !validOp)
+				{
+					printf("Bad condition, try: b 204 if V3 == 0x10\n");
+					return;
+				}
+
+				bp.op = op;
+				bp.value = strtoul(value.c_str(), nullptr, 0);
+			}
+
+			m_breakpoints.push_back(bp);
+			setBit(m_breakBits, addr, true);
+			printf("Breakpoint at 0x%03X\n", addr);
+		}
+		else if (cmd == "d" && !arg1.empty())
+		{
+			m_breakpoints.erase(std::remove_if(m_breakpoints.begin(), m_breakpoints.end(), 
+				[&](const Breakpoint& bp) {return bp.addr == addr;}), m_breakpoints.end());
+			setBit(m_breakBits, addr, false);
+		}
+		else if ((cmd == "w" || cmd == "dw") && !arg1.empty())
+		{
+			const unsigned len = arg2.empty() ? 1 : std::max(1ul, strtoul(arg2.c_str(), nullptr, 0));
+			const bool reads = cmd == "dw" || arg3.find('r') != std::string::npos;
+			const bool writes = cmd == "dw" || arg3.empty() || arg3.find('w') != std::string::npos;
+
+			for (unsigned i = 0; i < len && addr + i < Ram::size; i++)
+			{
+				if (reads) setBit(m_readWatch, addr + i, cmd == "w");
+				if (writes) setBit(m_writeWatch, addr + i, cmd == "w");
+			}
+		}
+		else if (cmd == "bl")
+		{
+			for (const Breakpoint& bp : m_breakpoints)
+			{
+				if (bp.reg < 0) printf("0x%03X\n", bp.addr);
+				else if (bp.reg == 0x10) printf("0x%03X if I %s %u\n", bp.addr, bp.op.c_str(), bp.value);
+				else printf("0x%03X if V%X %s %u\n", bp.addr, bp.reg, bp.op.c_str(), bp.value);
+			}
+		}
+		else if (cmd == "c")
+		{
+			resume(true);
+		}
+		else if (cmd == "s")
+		{
+			m_steps = arg1.empty() ? 1 : std::max(1, atoi(arg1.c_str()));
+			resume(true);
+		}
+		else if (cmd == "n")
+		{
+			const uint16_t pc = chip8.getPC();
+			if ((chip8.peek(pc) & 0xF0) == 0x20)
+			{
+				m_overPC = pc + 2;
+				m_overSP = chip8.getSP();
+			}
+			else
+			{
+				m_steps = 1;
+			}
+			resume(true);
+		}
+		else if (cmd == "p")
+		{
+			if (!m_paused) stop(chip8, "Paused");
+			return;
+		}
+		else if (cmd == "r")
+		{
+			printRegisters(chip8);
+		}
+		else if (cmd == "x")
+		{
+			const int len = arg2.empty() ? 16 : atoi(arg2.c_str());
+			for (int i = 0; i < len; i++)
+			{
+				if (i % 16 == 0) printf("%s0x%03X:", i ? "\n" : "", addr + i);
+				printf(" %02X", chip8.peek(addr + i));
+			}
+			printf("\n");
+		}
+		else if (cmd == "l")
+		{
+			printListing(chip8, addr, arg2.empty() ? 8 : atoi(arg2.c_str()));
+		}
+		else if (!cmd.empty())
+		{
+			printHelp();
+		}
+
+		if (m_paused)
+		{
+			printf("(c8db) ");
+			fflush(stdout);
+		}
+	}
+
+public:
+	// Starts paused at the first instruction so breakpoints can be set
+	void start(const Chip8& chip8)
+	{
+		printf("Debugger attached, type h for help\n");
+		stop(chip8, "Paused");
+
+		// Reading stdin blocks so it gets its own thread, it is never joined 
+		// because it can be stuck in fgets when the window closes
+		std::thread([input = m_input]()
+		{
+			char line[256];
+			while (fgets(line, sizeof(line), stdin))
+			{
+				std::lock_guard lock{input->mutex};
+				input->lines.emplace_back(line);
+			}
+		}).detach();
+	}
+
+	// Runs the commands typed since the last frame
+	void poll(Chip8& chip8)
+	{
+		std::deque<std::string> lines;
+		{
+			std::lock_guard lock{m_input->mutex};
+			lines.swap(m_input->lines);
+		}
+
+		for (const std::string& line : lines)
+			execute(chip8, line);
+	}
+
+	bool isPaused() const {return m_paused;}
+
+	bool beforeCycle(Chip8& chip8)
+	{
+		if (chip8.getFaults() != m_faults)
+			return faultHit(chip8);
+
+		const uint16_t pc = chip8.getPC() & (Ram::size - 1);
+		if (m_slowPath) 
+			return slowBeforeCycle(chip8, pc);
+
+		return !testBit(m_breakBits, pc) || !breakHit(chip8, pc) || stop(chip8, "Breakpoint");
+	}
+
+	void onRead(uint16_t addr, uint8_t value)
+	{
+		if (testBit(m_readWatch, addr)) watch(addr, "read", value);
+	}
+
+	void onWrite(uint16_t addr, uint8_t value)
+	{
+		if (testBit(m_writeWatch, addr)) watch(addr, "write", value);
+	}
+};
+
+// Tells when the rom file changed on disk. Uses inotify on linux and checks 
+// the modification time a few times a second everywhere else
+class RomWatcher
+{
+private:
+	std::filesystem::path m_path;
+#ifdef __linux__
+	int m_fd = -1;
+#else
+	std::filesystem::file_time_type m_lastWrite{};
+	int m_countdown = 0;
+#endif
+
+public:
+	RomWatcher(const char* path) : m_path{path}
+	{
+#ifdef __linux__
+		// Watch the directory, a lot of tools replace the file instead of 
+		// writing into it
+		m_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		const std::string dir = m_path.has_parent_path() ? m_path.parent_path().string() : ".";
+		if (m_fd < 0 || inotify_add_watch(m_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+			SDL_Log("Could not watch \"%s\" for changes\n", dir.c_str());
+#else
+		std::error_code error;
+		m_lastWrite = std::filesystem::last_write_time(m_path, error);
+#endif
+	}
+
+	~RomWatcher()
+	{
+#ifdef __linux__
+		if (m_fd >= 0)
+			close(m_fd);
+#endif
+	}
+
+	RomWatcher(const RomWatcher&) = delete;
+	RomWatcher& operator=(const RomWatcher&) = delete;
+
+	// Cheap enough to call every frame
+	bool changed()
+	{
+#ifdef __linux__
+		bool changed = false;
+		alignas(inotify_event) char buffer[4096];
+		ssize_t len;
+
+		while ((len = read(m_fd, buffer, sizeof(buffer))) > 0)
+		{
+			for (char* ptr = buffer; ptr < buffer + len;)
+			{
+				const inotify_event* ev = reinterpret_cast<const inotify_event*>(ptr);
+				if (ev->len && m_path.filename() == ev->name)
+					changed = true;
+
+				ptr += sizeof(inotify_event) + ev->len;
+			}
+		}
+
+		return changed;
+#else
+		if (--m_countdown > 0) return false;
+		m_countdown = 15;
+
+		std::error_code error;
+		const auto lastWrite = std::filesystem::last_write_time(m_path, error);
+		if (error || lastWrite == m_lastWrite) return false;
+
+		m_lastWrite = lastWrite;
+		return true;
+#endif
+	}
+};
+
+// Reboots the rom from disk in place. With keepState the save state is put 
+// back with the new program patched into it
+void reloadProgram(Chip8& chip8, const Chip8* saveState, bool keepState)
+{
+	const auto start = std::chrono::steady_clock::now();
+
+	std::vector<uint8_t> program;
+	if (!Chip8::readProgram(Config::romPath, program))
+		return;
+
+	if (keepState && saveState)
+	{
+		chip8 = *saveState;
+		chip8.patchProgram(program);
+	}
+	else
+	{
+		chip8.loadProgram(program);
+	}
+
+	const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	SDL_Log("Reloaded %s%s in %.3fms\n", Config::romPath, keepState && saveState ? " into the save state" : "", ms);
+}
+
+// Emulates one 60hz frame worth of instructions and ticks the timers. Returns
+// true if the screen needs to be redrawn
+template <typename Hooks>
+bool runFrame(Chip8& chip8, int clockSpeed, Hooks& hooks)
+{
+	bool screenRefreshed = false;
+
+	for (int i = 0; i < clockSpeed / 60; i++)
+	{
+		if (!hooks.beforeCycle(chip8)) break;
+
+		// Emulate a cycle
+		chip8.emulateCycle(hooks);
+
+		// Break if the screen needs to be redrawn
+		if (chip8.refreshScreen())
+		{
+			// Looks like a bit of a workaround but it looks nicer imo
+			screenRefreshed = true;
+			break;
+		}
+	}
+
+	chip8.updateTimers();
+
+	return screenRefreshed;
+}
+
+bool runFrame(Chip8& chip8, int clockSpeed = Global::clockSpeed)
+{
+	FrameHooks hooks;
+	return runFrame(chip8, clockSpeed, hooks);
+}
+
+// Minimal non blocking UDP socket talking to a single peer
+class UdpSocket
+{
+private:
+#ifdef _WIN32
+	SOCKET m_sock = INVALID_SOCKET;
+#else
+	int m_sock = -1;
+#endif
+	sockaddr_in m_peer{};
+
+public:
+	UdpSocket() = default;
+	UdpSocket(const UdpSocket&) = delete;
+	UdpSocket& operator=(const UdpSocket&) = delete;
+
+	~UdpSocket()
+	{
+#ifdef _WIN32
+		if (m_sock != INVALID_SOCKET)
+		{
+			closesocket(m_sock);
+			WSACleanup();
+		}
+#else
+		if (m_sock >= 0)
+			close(m_sock);
+#endif
+	}
+
+	bool open(uint16_t localPort, const char* peerHost, uint16_t peerPort)
+	{
+#ifdef _WIN32
+		WSADATA wsa;
+		if (WSAStartup(MAKEWORD(2, 2), &wsa))
+			return false;
+#endif
+		addrinfo hints{};
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_DGRAM;
+		addrinfo* result = nullptr;
+		if (getaddrinfo(peerHost, nullptr, &hints, &result) || !result)
+		{
+			SDL_Log("Could not resolve \"%s\"\n", peerHost);
+			return false;
+		}
+		m_peer = *reinterpret_cast<sockaddr_in*>(result->ai_addr);
+		m_peer.sin_port = htons(peerPort);
+		freeaddrinfo(result);
+
+		m_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		sockaddr_in local{};
+		local.sin_family = AF_INET;
+		local.sin_addr.s_addr = htonl(INADDR_ANY);
+		local.sin_port = htons(localPort);
+
+#ifdef _WIN32
+		u_long nonBlocking = 1;
+		if (m_sock == INVALID_SOCKET || ioctlsocket(m_sock, FIONBIO, &nonBlocking))
+			return false;
+#else
+		if (m_sock < 0 || fcntl(m_sock, F_SETFL, fcntl(m_sock, F_GETFL) | O_NONBLOCK))
+			return false;
+#endif
+		if (bind(m_sock, reinterpret_cast<sockaddr*>(&local), sizeof(local)))
+		{
+			SDL_Log("Could not bind the udp port %u\n", localPort);
+			return false;
+		}
+
+		return true;
+	}
+
+	void send(const uint8_t* data, int len)
+	{
+		sendto(m_sock, reinterpret_cast<const char*>(data), len, 0, reinterpret_cast<sockaddr*>(&m_peer), sizeof(m_peer));
+	}
+
+	// Returns the packet length, or -1 when nothing is waiting
+	int receive(uint8_t* data, int len)
+	{
+		return recv(m_sock, reinterpret_cast<char*>(data), len, 0);
+	}
+};
+
+// Rollback netplay for two players sharing the keypad. Every frame runs right
+// away with a guess for the remote keys (the last ones we know). When the real
+// keys arrive and the guess was wrong, the machine goes back to the snapshot of
+// that frame and plays the frames since then again
+class Netplay
+{
+private:
+	static constexpr int m_maxRollback = 8;				// Frames we may run ahead of the peer
+	static constexpr int m_sendWindow = 2 * m_maxRollback + 2;
+	static constexpr int m_history = 64;				// Frames of input kept, power of 2
+	static constexpr uint32_t m_magic = 0x504E3843;		// "C8NP"
+
+	struct FrameInput
+	{
+		int64_t frame = -1;		// Frame this slot belongs to
+		uint16_t local{};
+		uint16_t remote{};		// Confirmed or predicted
+		bool confirmed = false;
+		uint16_t used{};		// Remote keys the frame was simulated with
+	};
+
+	struct Outgoing
+	{
+		std::chrono::steady_clock::time_point due;
+		std::vector<uint8_t> data;
+	};
+
+	struct Stats
+	{
+		int frames{};
+		int rollbacks{};
+		int rollbackFrames{};
+		int maxDepth{};
+		int stalls{};
+		double resimMs{};
+		double maxResimMs{};
+	};
+
+	UdpSocket m_socket;
+	int m_delayMs;
+	int m_jitterMs;
+	std::vector<Outgoing> m_outgoing;
+
+	int64_t m_frame{};					// Next frame to simulate
+	int64_t m_confirmed = -1;			// Every remote input up to here is known
+	uint16_t m_lastRemote{};			// Keys of the newest confirmed frame
+	std::array<FrameInput, m_history> m_inputs{};
+	std::vector<Chip8> m_snapshots;		// State at the start of each frame
+	Stats m_stats{};
+
+	FrameInput& input(int64_t frame) {return m_inputs[frame & (m_history - 1)];}
+	Chip8& snapshot(int64_t frame) {return m_snapshots[frame % m_snapshots.size()];}
+
+	uint16_t predictRemote(int64_t frame)
+	{
+		FrameInput& in = input(frame);
+		return in.frame == frame && in.confirmed ? in.remote : m_lastRemote;
+	}
+
+	// Plays a frame with the known or predicted keys of both players
+	void simulate(Chip8& chip8, int64_t frame)
+	{
+		snapshot(frame) = chip8;
+
+		FrameInput& in = input(frame);
+		in.used = predictRemote(frame);
+		chip8.setKeys(in.local | in.used);
+		::runFrame(chip8, Config::normalClockSpeed);
+	}
+
+	// Returns the oldest frame that was simulated with wrong remote keys
+	int64_t receive()
+	{
+		int64_t rollbackTo = m_frame;
+		uint8_t packet[512];
+		int len;
+
+		while ((len = m_socket.receive(packet, sizeof(packet))) >= 9)
+		{
+			uint32_t magic, first;
+			memcpy(&magic, packet, 4);
+			memcpy(&first, packet + 4, 4);
+			const int count = std::min<int>(packet[8], (len - 9) / 2);
+			if (magic != m_magic) continue;
+
+			for (int i = 0; i < count; i++)
+			{
+				const int64_t frame = static_cast<int64_t>(first) + i;
+				if (frame <= m_confirmed || frame >= m_confirmed + m_history) continue;
+
+				uint16_t keys;
+				memcpy(&keys, packet + 9 + i * 2, 2);
+
+				FrameInput& in = input(frame);
+				if (in.frame != frame)
+					in = FrameInput{frame};
+
+				in.remote = keys;
+				in.confirmed = true;
+
+				if (frame < m_frame && in.used != keys)
+					rollbackTo = std::min(rollbackTo, frame);
+			}
+
+			while (input(m_confirmed + 1).frame == m_confirmed + 1 && input(m_confirmed + 1).confirmed)
+				m_lastRemote = input(++m_confirmed).remote;
+		}
+
+		return rollbackTo;
+	}
+
+	void send()
+	{
+		const int64_t first = std::max<int64_t>(0, m_frame - m_sendWindow);
+		const int count = m_frame - first;
+
+		std::vector<uint8_t> packet(9 + count * 2);
+		const uint32_t first32 = first;
+		memcpy(&packet[0], &m_magic, 4);
+		memcpy(&packet[4], &first32, 4);
+		packet[8] = count;
+		for (int i = 0; i < count; i++)
+			memcpy(&packet[9 + i * 2], &input(first + i).local, 2);
+
+		// Fake network conditions to test with on localhost
+		const int delay = m_delayMs + (m_jitterMs > 0 ? Random::get(0, m_jitterMs) : 0);
+		m_outgoing.push_back({std::chrono::steady_clock::now() + std::chrono::milliseconds(delay), std::move(packet)});
+
+		const auto now = std::chrono::steady_clock::now();
+		for (std::size_t i = 0; i < m_outgoing.size();)
+		{
+			if (m_outgoing[i].due > now)
+			{
+				i++;
+				continue;
+			}
+
+			m_socket.send(m_outgoing[i].data.data(), m_outgoing[i].data.size());
+			m_outgoing[i] = std::move(m_outgoing.back());
+			m_outgoing.pop_back();
+		}
+	}
+
+	void report()
+	{
+		if (++m_stats.frames < 60) return;
+
+		SDL_Log("Netplay frame %lld: %d rollbacks, %.1f frames avg, %d max, resim %.3fms avg %.3fms max, %d stalls, %lld frames unconfirmed\n",
+				static_cast<long long>(m_frame), m_stats.rollbacks, 
+				m_stats.rollbacks ? static_cast<double>(m_stats.rollbackFrames) / m_stats.rollbacks : 0.0, 
+				m_stats.maxDepth, m_stats.rollbacks ? m_stats.resimMs / m_stats.rollbacks : 0.0, 
+				m_stats.maxResimMs, m_stats.stalls, static_cast<long long>(m_frame - m_confirmed - 1));
+
+		m_stats = {};
+	}
+
+public:
+	Netplay(int delayMs, int jitterMs) : m_delayMs{delayMs}, m_jitterMs{jitterMs} {}
+
+	bool start(const Chip8& chip8, uint16_t localPort, const char* peerHost, uint16_t peerPort)
+	{
+		m_snapshots.assign(m_maxRollback + 1, chip8);
+		if (!m_socket.open(localPort, peerHost, peerPort))
+			return false;
+
+		SDL_Log("Netplay on port %u with %s:%u\n", localPort, peerHost, peerPort);
+		return true;
+	}
+
+	// Next frame to simulate, it doesn't move while waiting for the peer
+	int64_t getFrame() const {return m_frame;}
+
+	// Runs one frame, rolling back first if a prediction turned out wrong. The
+	// keypad of the machine holds the local keys before and after
+	bool runFrame(Chip8& chip8)
+	{
+		const uint16_t localKeys = chip8.getKeys();
+
+		const int64_t rollbackTo = receive();
+		if (rollbackTo < m_frame)
+		{
+			const auto start = std::chrono::steady_clock::now();
+
+			chip8 = snapshot(rollbackTo);
+			for (int64_t frame = rollbackTo; frame < m_frame; frame++)
+				simulate(chip8, frame);
+
+			const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			m_stats.rollbacks++;
+			m_stats.rollbackFrames += m_frame - rollbackTo;
+			m_stats.maxDepth = std::max<int>(m_stats.maxDepth, m_frame - rollbackTo);
+			m_stats.resimMs += ms;
+			m_stats.maxResimMs = std::max(m_stats.maxResimMs, ms);
+		}
+
+		// Wait for the peer when a wrong guess could no longer be rolled back
+		if (m_frame - m_confirmed > m_maxRollback)
+		{
+			m_stats.stalls++;
+		}
+		else
+		{
+			// The peer's keys for this frame may already be in the slot
+			FrameInput& in = input(m_frame);
+			if (in.frame != m_frame)
+				in = FrameInput{m_frame};
+
+			in.local = localKeys;
+			simulate(chip8, m_frame++);
+		}
+
+		send();
+		report();
+
+		chip8.setKeys(localKeys);
+		return true;
+	}
+};
+
+// Keeps track of how much of the frame budget emulation and run-ahead eat
+struct FrameStats
+{
+	int frames{};
+	double emulateMs{};
+	double runAheadMs{};
+	double worstMs{};
+
+	void add(double emulate, double runAhead)
+	{
+		frames++;
+		emulateMs += emulate;
+		runAheadMs += runAhead;
+		worstMs = std::max(worstMs, emulate + runAhead);
+	}
+
+	// Logs the averages about once a second and starts over
+	void report()
+	{
+		if (frames < 60) return;
+
+		const double avg = (emulateMs + runAheadMs) / frames;
+		SDL_Log("Run-ahead %d: emulate %.3fms, run-ahead %.3fms, worst %.3fms, headroom %.2fms (%.0f%%)\n",
+				Config::runAheadFrames, emulateMs / frames, runAheadMs / frames, worstMs,
+				Config::frameTime - avg, 100.0 * (Config::frameTime - avg) / Config::frameTime);
+
+		*this = {};
+	}
+};
+
+// Main loop function
+void loop(sdl_t& sdl, Chip8& chip8)
+{
+	chip8.loadProgram(Config::romPath);
+	SDL_Surface* chip8Surf = SDL_CreateRGBSurface(0, 
+							chip8.getWidth()*Config::scaleFac,
+							chip8.getHeight()*Config::scaleFac, 32, 0, 0, 0, 0);
+
+	SDL_FillRect(chip8Surf, 0, Config::bgColor);
+
+	// The machine that run-ahead plays the future frames on. It is reused 
+	// every frame so the snapshot only swaps ram page references
+	Chip8 ahead{chip8};
+	FrameStats stats{};
+
+	std::unique_ptr<Profiler> profiler{};
+	if (Config::profileInterval > 0)
+		profiler = std::make_unique<Profiler>(Config::profileInterval);
+
+	std::unique_ptr<Chip8> saveState{};
+	std::unique_ptr<RomWatcher> watcher{};
+	if (Config::hotReload)
+		watcher = std::make_unique<RomWatcher>(Config::romPath);
+
+	std::unique_ptr<Netplay> netplay{};
+	if (Config::netLocalPort)
+	{
+		std::string host{Config::netPeer};
+		const std::size_t colon = host.rfind(':');
+		const int peerPort = colon == std::string::npos ? 0 : atoi(host.c_str() + colon + 1);
+		host = host.substr(0, colon);
+
+		netplay = std::make_unique<Netplay>(Config::netDelayMs, Config::netJitterMs);
+		if (!peerPort || !netplay->start(chip8, Config::netLocalPort, host.c_str(), peerPort))
+		{
+			SDL_Log("Could not start netplay, playing alone\n");
+			netplay.reset();
+		}
+	}
+
+	std::unique_ptr<Debugger> debugger{};
+	if (Config::debugger)
+	{
+		debugger = std::make_unique<Debugger>();
+		debugger->start(chip8);
+	}
+
+	bool running = true;
+	while (running)
+	{
+		const double startFrame = SDL_GetPerformanceCounter();
+		bool screenshot = false;
+		bool reload = watcher && watcher->changed();
+
+		// Update the window surface
+		SDL_Surface* winSurf = SDL_GetWindowSurface(sdl.window);
+		
+		SDL_Event ev;
+		while (SDL_PollEvent(&ev))
+		{
+			switch (ev.type)
+			{
+			case SDL_QUIT:
+				running = false;
+				break;
+
+			case SDL_KEYDOWN:
+                switch (ev.key.keysym.sym) 
+				{
+				case SDLK_ESCAPE:
+					running = false;
+					break;
+				
+				case SDLK_PERIOD:
+					if (Global::clockSpeed + 100 < Config::normalClockSpeed * Config::maxClockSpeedMp)
+						Global::clockSpeed += 100;
+					break;
+
+				case SDLK_COMMA:
+					if (Global::clockSpeed - 100 > Config::normalClockSpeed * Config::minClockSpeedMp)
+						Global::clockSpeed -= 100;
+					break;
+				
+				case SDLK_0:
+					Global::clockSpeed = Config::normalClockSpeed;
+					break;
+				
+				case SDLK_SPACE:
+				if (Global::clockSpeed == 0)
+				{
+					Global::clockSpeed = Config::normalClockSpeed;
+					printf("+---Unpaused---+\n");
+					break;
+				}
+					Global::clockSpeed = 0;
+					printf("+---Paused---+\n");
+					break;
+				
+				case SDLK_BACKQUOTE:
+					screenshot = true;
+					break;
+
+				// Reloads and save states change the machine behind the peer's 
+				// back, so they are off in netplay
+				case SDLK_F2:
+					reload = !netplay;
+					break;
+
+				case SDLK_F5:
+					if (netplay) break;
+					saveState = std::make_unique<Chip8>(chip8);
+					printf("+---Saved state---+\n");
+					break;
+
+				case SDLK_F9:
+					if (saveState && !netplay)
+					{
+						chip8 = *saveState;
+						printf("+---Loaded state---+\n");
+					}
+					break;
+				
+				// Map qwerty keys to CHIP8 keypad
+				case SDLK_1: chip8.keypad[0x1] = true; break;
+				case SDLK_2: chip8.keypad[0x2] = true; break;
+				case SDLK_3: chip8.keypad[0x3] = true; break;
+				case SDLK_4: chip8.keypad[0xC] = true; break;
+
+				case SDLK_q: chip8.keypad[0x4] = true; break;
+				case SDLK_w: chip8.keypad[0x5] = true; break;
+				case SDLK_e: chip8.keypad[0x6] = true; break;
+				case SDLK_r: chip8.keypad[0xD] = true; break;
+
+				case SDLK_a: chip8.keypad[0x7] = true; break;
+				case SDLK_s: chip8.keypad[0x8] = true; break;
+				case SDLK_d: chip8.keypad[0x9] = true; break;
+				case SDLK_f: chip8.keypad[0xE] = true; break;
+
+				case SDLK_z: chip8.keypad[0xA] = true; break;
+				case SDLK_x: chip8.keypad[0x0] = true; break;
+				case SDLK_c: chip8.keypad[0xB] = true; break;
+				case SDLK_v: chip8.keypad[0xF] = true; break;
+				
+				default: break;
+                }
+
+                break; 
+
+            case SDL_KEYUP:
+                switch (ev.key.keysym.sym) 
+				{
+				// Map qwerty keys to CHIP8 keypad
+				case SDLK_1: chip8.keypad[0x1] = false; break;
+				case SDLK_2: chip8.keypad[0x2] = false; break;
+				case SDLK_3: chip8.keypad[0x3] = false; break;
+				case SDLK_4: chip8.keypad[0xC] = false; break;
+
+				case SDLK_q: chip8.keypad[0x4] = false; break;
+				case SDLK_w: chip8.keypad[0x5] = false; break;
+				case SDLK_e: chip8.keypad[0x6] = false; break;
+				case SDLK_r: chip8.keypad[0xD] = false; break;
+
+				case SDLK_a: chip8.keypad[0x7] = false; break;
+				case SDLK_s: chip8.keypad[0x8] = false; break;
+				case SDLK_d: chip8.keypad[0x9] = false; break;
+				case SDLK_f: chip8.keypad[0xE] = false; break;
+
+				case SDLK_z: chip8.keypad[0xA] = false; break;
+				case SDLK_x: chip8.keypad[0x0] = false; break;
+				case SDLK_c: chip8.keypad[0xB] = false; break;
+				case SDLK_v: chip8.keypad[0xF] = false; break;
+
+				default: break;
+            	}
+
+                break;
+			}
+		}
+
+		if (reload)
+			reloadProgram(chip8, saveState.get(), Config::keepState);
+
+		// Emulate instructions at a speed of 60hz
+		const double startEmulate = SDL_GetPerformanceCounter();
+		bool screenRefreshed = false;
+		if (debugger)
+		{
+			debugger->poll(chip8);
+			if (!debugger->isPaused())
+				screenRefreshed = runFrame(chip8, Global::clockSpeed, *debugger);
+		}
+		else if (netplay)
+		{
+			// A rollback can change any frame so always redraw
+			screenRefreshed = netplay->runFrame(chip8);
+		}
+		else if (profiler)
+		{
+			screenRefreshed = runFrame(chip8, Global::clockSpeed, *profiler);
+		}
+		else
+		{
+			screenRefreshed = runFrame(chip8);
+		}
+		const double endEmulate = SDL_GetPerformanceCounter();
+
+		// Run-ahead: snapshot the machine, play the next frames with the keys
+		// that are held right now and show the last one. The real machine is
+		// never touched so the snapshot doesnt have to be restored. A paused
+		// debugger shows the real machine
+		const bool runAhead = Config::runAheadFrames > 0 && !(debugger && debugger->isPaused());
+		if (runAhead)
+		{
+			// Same clock as the real frame, netplay always runs at the normal one
+			const int clockSpeed = netplay ? Config::normalClockSpeed : Global::clockSpeed;
+
+			ahead = chip8;
+			for (int i = 0; i < Config::runAheadFrames; i++)
+				runFrame(ahead, clockSpeed);
+		}
+
+		// The future frame can differ even if nothing was drawn this frame, and
+		// the real one has to replace it once the debugger stops
+		if (Config::runAheadFrames > 0)
+			screenRefreshed = true;
+
+		const double endFrame = SDL_GetPerformanceCounter();
+
+		if (runAhead)
+		{
+			const double freq = SDL_GetPerformanceFrequency();
+			stats.add((endEmulate - startEmulate) * 1000.0 / freq, (endFrame - endEmulate) * 1000.0 / freq);
+			stats.report();
+		}
+
+		// Get the time elapsed since the previous frame and delay it by 60hz/s
+		const double timeElapsed = (endFrame - startFrame) * 1000.0 / SDL_GetPerformanceFrequency();
+		SDL_Delay(16.67f > timeElapsed ? 16.67f - timeElapsed : 0);
+
+		// Redraw the chip 8 screen
+		if (screenRefreshed)
+			(runAhead ? ahead : chip8).drawDisplay(chip8Surf);
+		
+		// This uses a separate surface for the chip8 display so it can be put 
+		// anywhere on the window. Might reuse in case I want to add UI
+		SDL_Rect chip8DisplayRect;
+		chip8DisplayRect.x = (winSurf->w - chip8.getWidth() * Config::scaleFac)/2;
+		chip8DisplayRect.y = (winSurf->h - chip8.getHeight() * Config::scaleFac)/2;
+		chip8DisplayRect.w = chip8.getWidth() * Config::scaleFac;
+		chip8DisplayRect.h = chip8.getHeight() * Config::scaleFac;
+
+		SDL_BlitScaled(chip8Surf, NULL, winSurf, &chip8DisplayRect);
 
 		drawInfo(winSurf, chip8);
 
-		SDL_UpdateWindowSurface(sdl.window);
+		SDL_UpdateWindowSurface(sdl.window);
+
+		if (screenshot)
+			shootScreenshot(sdl);
+		
+		// Cleanup (prob shouldve been put in the clean() function)
+		if (!running)
+			SDL_FreeSurface(chip8Surf);
+	}
+
+	if (profiler)
+	{
+		const std::string base = Config::romPath;
+		if (profiler->writeFolded((base + ".folded").c_str()) && profiler->writeListing((base + ".prof.txt").c_str(), chip8))
+			SDL_Log("Saved the profile to \"%s.folded\" and \"%s.prof.txt\"\n", base.c_str(), base.c_str());
+		else
+			SDL_Log("Failed to save the profile next to \"%s\"\n", base.c_str());
+	}
+}
+
+// Runs the function for every index in [0, count) spread over all cores
+template <typename Func>
+void parallelFor(int count, Func func)
+{
+	std::atomic<int> next{0};
+	std::vector<std::thread> workers;
+	const int threads = std::clamp<int>(std::thread::hardware_concurrency(), 1, std::max(count, 1));
+
+	for (int t = 0; t < threads; t++)
+		workers.emplace_back([&]()
+		{
+			for (int i = next++; i < count; i = next++)
+				func(i);
+		});
+
+	for (std::thread& worker : workers)
+		worker.join();
+}
+
+// Scripted keypad input, the keys are set at the start of the frame
+struct InputEvent
+{
+	uint32_t frame;
+	uint16_t keys;		// Keypad bit mask
+};
+
+// Parses "frame:mask,frame:mask,..." (the mask in hex), "-" means no input
+bool parseInput(const std::string& text, std::vector<InputEvent>& input)
+{
+	input.clear();
+	if (text == "-") return true;
+
+	std::istringstream stream{text};
+	std::string event;
+	while (std::getline(stream, event, ','))
+	{
+		unsigned frame, keys;
+		if (sscanf(event.c_str(), "%u:%x", &frame, &keys) != 2 || keys > 0xFFFF)
+			return false;
+
+		input.push_back({frame, static_cast<uint16_t>(keys)});
+	}
+
+	std::stable_sort(input.begin(), input.end(), 
+		[](const InputEvent& a, const InputEvent& b) {return a.frame < b.frame;});
+
+	return true;
+}
+
+// Runs the machine without a window at the normal clock speed until it has 
+// executed the given amount of instructions
+void runHeadless(Chip8& chip8, uint64_t cycles, const std::vector<InputEvent>& input)
+{
+	std::size_t next = 0;
+	for (uint32_t frame = 0; chip8.getCycles() < cycles; frame++)
+	{
+		while (next < input.size() && input[next].frame <= frame)
+			chip8.setKeys(input[next++].keys);
+
+		runFrame(chip8, Config::normalClockSpeed);
+	}
+}
+
+// One line of the conformance manifest:
+// <rom> <cycles> <seed> <input> [<display hash> [<ram hash> [<registers hash> [<faults>]]]]
+// Paths are relative to the manifest and "-" skips a hash. Faults is the hex
+// mask of the fault bits the rom is expected to raise, none by default
+struct GoldenCase
+{
+	std::string line;			// Kept as is for comments and blank lines
+	bool isCase = false;
+
+	std::string rom;
+	uint64_t cycles{};
+	uint32_t seed{};
+	std::string inputText;
+	std::vector<InputEvent> input;
+	std::string expected[3];	// Display, ram and registers hashes
+	uint8_t expectedFaults{};
+
+	uint64_t actual[3]{};
+	uint8_t faults{};
+	uint8_t firstFault{};
+	uint16_t faultPC{};
+	double seconds{};
+	bool loaded = false;
+};
+
+bool parseGoldenCase(GoldenCase& c)
+{
+	std::istringstream stream{c.line};
+	std::string first;
+	if (!(stream >> first) || first[0] == '#')
+		return true;
+
+	c.isCase = true;
+	c.rom = first;
+	if (!(stream >> c.cycles >> c.seed >> c.inputText) || !parseInput(c.inputText, c.input))
+		return false;
+
+	for (std::string& hash : c.expected)
+		if (!(stream >> hash)) hash = "-";
+
+	std::string faults;
+	if (stream >> faults && faults != "-")
+	{
+		char* end;
+		const unsigned long mask = strtoul(faults.c_str(), &end, 16);
+		if (*end || mask >= 1u << Fault::count) return false;
+		c.expectedFaults = mask;
+	}
+
+	return true;
+}
+
+bool loadManifest(const char* manifestPath, std::vector<GoldenCase>& cases)
+{
+	std::ifstream manifest{manifestPath};
+	if (!manifest)
+	{
+		SDL_Log("Could not open the manifest \"%s\"\n", manifestPath);
+		return false;
+	}
+
+	for (std::string line; std::getline(manifest, line);)
+	{
+		cases.emplace_back();
+		cases.back().line = line;
+		if (!parseGoldenCase(cases.back()))
+		{
+			SDL_Log("Malformed manifest line %zu: %s\n", cases.size(), line.c_str());
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Runs every rom in the manifest headless and compares the state hashes with 
+// the stored ones, or stores them when recording
+bool runGolden(const char* manifestPath, bool record)
+{
+	std::vector<GoldenCase> cases;
+	if (!loadManifest(manifestPath, cases))
+		return false;
+
+	const std::filesystem::path dir = std::filesystem::path{manifestPath}.parent_path();
+
+	// A broken rom can log on every instruction, the results say enough
+	SDL_LogSetPriority(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_CRITICAL);
+
+	parallelFor(cases.size(), [&](int i)
+	{
+		GoldenCase& c = cases[i];
+		if (!c.isCase) return;
+
+		Chip8 chip8{};
+		chip8.seed(c.seed);
+		c.loaded = chip8.loadProgram((dir / c.rom).string().c_str());
+		if (!c.loaded) return;
+
+		const auto start = std::chrono::steady_clock::now();
+		runHeadless(chip8, c.cycles, c.input);
+		c.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		c.actual[0] = chip8.displayHash();
+		c.actual[1] = chip8.ramHash();
+		c.actual[2] = chip8.registersHash();
+		c.faults = chip8.getFaults();
+		c.firstFault = chip8.getFirstFault();
+		c.faultPC = chip8.getFaultPC();
+	});
+
+	SDL_LogSetPriority(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_INFO);
+
+	const char* names[] = {"display", "ram", "registers"};
+	int failed = 0, total = 0;
+
+	for (GoldenCase& c : cases)
+	{
+		if (!c.isCase) continue;
+		total++;
+
+		const double mips = c.seconds > 0 ? c.cycles / c.seconds / 1e6 : 0.0;
+		bool pass = c.loaded;
+
+		for (int h = 0; pass && !record && h < 3; h++)
+		{
+			char actual[17];
+			snprintf(actual, sizeof(actual), "%016llx", static_cast<unsigned long long>(c.actual[h]));
+
+			if (c.expected[h] != "-" && c.expected[h] != actual)
+			{
+				printf("FAIL %s: %s hash %s, expected %s\n", c.rom.c_str(), names[h], actual, c.expected[h].c_str());
+				pass = false;
+			}
+		}
+
+		if (pass && !record && c.faults != c.expectedFaults)
+		{
+			printf("FAIL %s: faults %s (first %s at 0x%03X), expected %s\n", c.rom.c_str(), Fault::describe(c.faults).c_str(), 
+					Fault::describe(c.firstFault).c_str(), c.faultPC, Fault::describe(c.expectedFaults).c_str());
+			pass = false;
+		}
+
+		if (!c.loaded)
+			printf("FAIL %s: could not load the rom\n", c.rom.c_str());
+		else if (pass && c.faults)
+			printf("%s %s (%.2f MIPS, faults %s, first %s at 0x%03X)\n", record ? "REC " : "PASS", c.rom.c_str(), mips, 
+					Fault::describe(c.faults).c_str(), Fault::describe(c.firstFault).c_str(), c.faultPC);
+		else if (pass)
+			printf("%s %s (%.2f MIPS)\n", record ? "REC " : "PASS", c.rom.c_str(), mips);
+
+		failed += !pass;
+	}
+
+	printf("%d/%d passed\n", total - failed, total);
+
+	if (record && failed == 0)
+	{
+		std::ofstream out{manifestPath};
+		for (const GoldenCase& c : cases)
+		{
+			if (!c.isCase)
+			{
+				out << c.line << '\n';
+				continue;
+			}
+
+			char hashes[64];
+			snprintf(hashes, sizeof(hashes), "%016llx %016llx %016llx", 
+					static_cast<unsigned long long>(c.actual[0]), 
+					static_cast<unsigned long long>(c.actual[1]), 
+					static_cast<unsigned long long>(c.actual[2]));
+			out << c.rom << ' ' << c.cycles << ' ' << c.seed << ' ' << c.inputText << ' ' << hashes;
+			if (c.faults)
+				out << ' ' << std::hex << static_cast<unsigned>(c.faults) << std::dec;
+			out << '\n';
+		}
+		printf("Recorded the hashes into \"%s\"\n", manifestPath);
+	}
+
+	return failed == 0;
+}
+
+// Execution engines that can be checked against each other with --diff. The
+// first one is the reference
+struct Engine
+{
+	const char* name;
+	void (*step)(Chip8&);
+};
+
+constexpr Engine engines[] = {
+	{"switch", [](Chip8& c8) {c8.emulateCycle();}},
+	{"table", [](Chip8& c8) {c8.emulateCycleTable();}},
+};
+
+const Engine* findEngine(const std::string& name)
+{
+	for (const Engine& engine : engines)
+		if (name == engine.name) return &engine;
+
+	return nullptr;
+}
+
+// printf into the end of a string
+void appendf(std::string& out, const char* fmt, ...)
+{
+	char buffer[256];
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(buffer, sizeof(buffer), fmt, args);
+	va_end(args);
+	out += buffer;
+}
+
+// Two machines running the same rom and input on different engines, one 
+// instruction at a time. Copying it is a checkpoint
+struct Lockstep
+{
+	Chip8 machines[2];
+	uint32_t frame{};
+	int cycle{};				// Instruction inside the current frame
+	std::size_t nextInput{};
+	uint64_t steps{};
+};
+
+// The last instructions the reference executed, indexed by step
+struct TraceRing
+{
+	static constexpr std::size_t size = 1 << 16;
+
+	struct Entry
+	{
+		uint16_t pc;
+		uint16_t opcode;
+	};
+
+	std::vector<Entry> entries = std::vector<Entry>(size);
+
+	Entry& operator[](uint64_t step) {return entries[step & (size - 1)];}
+};
+
+// Runs one instruction on both machines with the same frame pacing as 
+// runHeadless(). Returns false if only one of them wants to redraw
+bool lockstepCycle(Lockstep& ls, const Engine* const pair[2], const std::vector<InputEvent>& input, TraceRing& trace)
+{
+	if (ls.cycle == 0)
+	{
+		while (ls.nextInput < input.size() && input[ls.nextInput].frame <= ls.frame)
+		{
+			for (Chip8& c8 : ls.machines)
+				c8.setKeys(input[ls.nextInput].keys);
+			ls.nextInput++;
+		}
+	}
+
+	const Chip8& ref = ls.machines[0];
+	trace[ls.steps] = {ref.getPC(), static_cast<uint16_t>((ref.peek(ref.getPC()) << 8) | ref.peek(ref.getPC() + 1))};
+	ls.steps++;
+
+	pair[0]->step(ls.machines[0]);
+	pair[1]->step(ls.machines[1]);
+
+	const bool refresh0 = ls.machines[0].refreshScreen();
+	const bool refresh1 = ls.machines[1].refreshScreen();
+
+	if (refresh0 || ++ls.cycle >= Config::normalClockSpeed / 60)
+	{
+		for (Chip8& c8 : ls.machines)
+			c8.updateTimers();
+		ls.cycle = 0;
+		ls.frame++;
+	}
+
+	return refresh0 == refresh1;
+}
+
+// Hashes the machine state, rehashing only the ram pages written since the
+// last call
+struct StateHasher
+{
+	std::array<uint64_t, Ram::pageCount> pages{};
+
+	uint64_t hash(Chip8& c8, bool full = false)
+	{
+		const uint16_t dirty = full ? 0xFFFF : c8.takeDirtyPages();
+		for (int i = 0; i < Ram::pageCount; i++)
+			if ((dirty >> i) & 1) pages[i] = c8.ramPageHash(i);
+
+		uint64_t hash = Hash::fnv1a(pages.data(), sizeof(pages));
+		hash ^= c8.registersHash() * 31;
+		hash ^= (c8.getKeyLatch() | c8.getFaults() << 16) * 0x9E3779B97F4A7C15ull;
+		return hash ^ c8.displayHash() * 17;
+	}
+};
+
+bool sameState(const Chip8& a, const Chip8& b)
+{
+	return a.registersHash() == b.registersHash() && a.getKeyLatch() == b.getKeyLatch() && a.getFaults() == b.getFaults()
+		&& a.displayHash() == b.displayHash() && a.ramHash() == b.ramHash();
+}
+
+// Writes what differs between the two machines
+void describeDiff(const Chip8& a, const Chip8& b, std::string& out)
+{
+	for (int i = 0; i < 16; i++)
+		if (a.getV(i) != b.getV(i)) appendf(out, "  V%X: %02X vs %02X\n", i, a.getV(i), b.getV(i));
+	if (a.getPC() != b.getPC()) appendf(out, "  PC: %03X vs %03X\n", a.getPC(), b.getPC());
+	if (a.getI() != b.getI()) appendf(out, "  I: %03X vs %03X\n", a.getI(), b.getI());
+	if (a.getSP() != b.getSP()) appendf(out, "  SP: %d vs %d\n", a.getSP(), b.getSP());
+	for (int i = 0; i < std::min(a.getSP(), b.getSP()); i++)
+		if (a.getStack(i) != b.getStack(i)) appendf(out, "  stack[%d]: %03X vs %03X\n", i, a.getStack(i), b.getStack(i));
+	if (a.getDelayTimer() != b.getDelayTimer()) appendf(out, "  DT: %02X vs %02X\n", a.getDelayTimer(), b.getDelayTimer());
+	if (a.getSoundTimer() != b.getSoundTimer()) appendf(out, "  ST: %02X vs %02X\n", a.getSoundTimer(), b.getSoundTimer());
+	if (a.getKeyLatch() != b.getKeyLatch()) appendf(out, "  FX0A key latch: %03X vs %03X\n", a.getKeyLatch(), b.getKeyLatch());
+	if (a.getFaults() != b.getFaults()) appendf(out, "  faults: %X vs %X\n", a.getFaults(), b.getFaults());
+
+	int shown = 0;
+	for (int addr = 0; addr < Ram::size; addr++)
+		if (a.peek(addr) != b.peek(addr) && shown++ < 16)
+			appendf(out, "  ram[%03X]: %02X vs %02X\n", addr, a.peek(addr), b.peek(addr));
+	if (shown > 16) appendf(out, "  ... %d more ram bytes\n", shown - 16);
+
+	for (int y = 0; y < a.getHeight(); y++)
+	{
+		bool differs = false;
+		for (int x = 0; x < a.getWidth(); x++)
+			differs |= a.getPixel(x, y) != b.getPixel(x, y);
+		if (!differs) continue;
+
+		appendf(out, "  row %2d: ", y);
+		for (int x = 0; x < a.getWidth(); x++)
+			out += a.getPixel(x, y) == b.getPixel(x, y) ? '.' : (a.getPixel(x, y) ? 'A' : 'B');
+		out += '\n';
+	}
+}
+
+// Runs the rom on two engines and compares their state every interval 
+// instructions. After a mismatch it replays from the last matching checkpoint
+// one instruction at a time to find the first one that differs
+bool runDiffCase(const GoldenCase& c, const std::vector<uint8_t>& program, const Engine* const pair[2], 
+				 int interval, std::string& report)
+{
+	Lockstep ls{};
+	for (Chip8& c8 : ls.machines)
+	{
+		c8.seed(c.seed);
+		c8.loadProgram(program);
+	}
+
+	TraceRing trace;
+	StateHasher hashers[2];
+	hashers[0].hash(ls.machines[0], true);
+	hashers[1].hash(ls.machines[1], true);
+
+	Lockstep checkpoint = ls;
+	uint64_t checks = 0;
+	const auto start = std::chrono::steady_clock::now();
+
+	while (ls.steps < c.cycles)
+	{
+		const bool sameDraw = lockstepCycle(ls, pair, c.input, trace);
+		if (sameDraw && ls.steps % interval != 0 && ls.steps < c.cycles)
+			continue;
+
+		checks++;
+		if (sameDraw && hashers[0].hash(ls.machines[0]) == hashers[1].hash(ls.machines[1]))
+		{
+			checkpoint = ls;
+			continue;
+		}
 
-		if (screenshot)
-			shootScreenshot(sdl);
-		
-		// Cleanup (prob shouldve been put in the clean() function)
-		if (!running)
-			SDL_FreeSurface(chip8Surf);
+		// Find the exact instruction
+		const uint64_t end = ls.steps;
+		ls = checkpoint;
+		while (ls.steps < end)
+		{
+			if (!lockstepCycle(ls, pair, c.input, trace) || !sameState(ls.machines[0], ls.machines[1]))
+				break;
+		}
+
+		appendf(report, "DIFF %s: %s and %s diverge at instruction %llu (frame %u)\n", c.rom.c_str(), 
+				pair[0]->name, pair[1]->name, static_cast<unsigned long long>(ls.steps), ls.frame);
+
+		constexpr uint64_t window = 16;
+		char text[32];
+		for (uint64_t step = ls.steps > window ? ls.steps - window : 0; step < ls.steps; step++)
+		{
+			disassemble(trace[step].opcode, text, sizeof(text));
+			appendf(report, "%s 0x%03X  %04X  %s\n", step + 1 == ls.steps ? ">" : " ", trace[step].pc, trace[step].opcode, text);
+		}
+
+		describeDiff(ls.machines[0], ls.machines[1], report);
+		if (ls.machines[0].refreshScreen() != ls.machines[1].refreshScreen())
+			appendf(report, "  draw flag differs\n");
+		return false;
+	}
+
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	appendf(report, "SAME %s (%llu instructions, %llu checks, %.2f MIPS)\n", c.rom.c_str(), 
+			static_cast<unsigned long long>(ls.steps), static_cast<unsigned long long>(checks), 
+			seconds > 0 ? ls.steps / seconds / 1e6 : 0.0);
+	if (ls.machines[0].getFaults())
+		appendf(report, "  both raised faults %s, first %s at 0x%03X\n", Fault::describe(ls.machines[0].getFaults()).c_str(), 
+				Fault::describe(ls.machines[0].getFirstFault()).c_str(), ls.machines[0].getFaultPC());
+	return true;
+}
+
+// Runs every rom in the manifest on both engines, spread over all cores
+bool runDiff(const char* manifestPath, const char* enginePair, int interval)
+{
+	std::string names{enginePair};
+	const std::size_t comma = names.find(',');
+	const Engine* pair[2] = {findEngine(names.substr(0, comma)), 
+		comma == std::string::npos ? nullptr : findEngine(names.substr(comma + 1))};
+
+	if (!pair[0] || !pair[1])
+	{
+		SDL_Log("Unknown engines \"%s\", pick two of:", enginePair);
+		for (const Engine& engine : engines)
+			SDL_Log("  %s", engine.name);
+		return false;
+	}
+
+	std::vector<GoldenCase> cases;
+	if (!loadManifest(manifestPath, cases))
+		return false;
+
+	const std::filesystem::path dir = std::filesystem::path{manifestPath}.parent_path();
+	std::vector<std::string> reports(cases.size());
+	std::atomic<int> failed{0}, total{0};
+
+	SDL_LogSetPriority(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_CRITICAL);
+
+	parallelFor(cases.size(), [&](int i)
+	{
+		if (!cases[i].isCase) return;
+		total++;
+
+		std::vector<uint8_t> program;
+		if (!Chip8::readProgram((dir / cases[i].rom).string().c_str(), program))
+		{
+			appendf(reports[i], "FAIL %s: could not load the rom\n", cases[i].rom.c_str());
+			failed++;
+		}
+		else if (!runDiffCase(cases[i], program, pair, interval, reports[i]))
+		{
+			failed++;
+		}
+	});
+
+	SDL_LogSetPriority(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_INFO);
+
+	for (const std::string& report : reports)
+		printf("%s", report.c_str());
+	printf("%d/%d matched\n", total - failed, total.load());
+
+	return failed == 0;
+}
+
+// Guest edge coverage, every (previous PC, PC) pair sets one bit of a 64K 
+// bit map
+struct CoverageHooks : FrameHooks
+{
+	static constexpr int bits = 1 << 16;
+
+	std::array<uint64_t, bits / 64> map{};
+	uint16_t prev{};
+
+	bool beforeCycle(const Chip8& chip8)
+	{
+		const uint16_t pc = chip8.getPC();
+		const uint16_t edge = pc ^ static_cast<uint16_t>(prev * 0x9E5);
+		map[edge >> 6] |= 1ull << (edge & 63);
+		prev = pc;
+		return true;
+	}
+};
+
+// What the fuzzer feeds a machine: the program and the keys to press
+struct FuzzInput
+{
+	std::vector<uint8_t> rom;
+	std::vector<InputEvent> keys;
+};
+
+// In process fuzzer. Every worker mutates inputs from the shared corpus, runs
+// them on its own machine and keeps the ones that reach new edges. Inputs that
+// raise a new fault are written out as a rom and a manifest line that 
+// --golden, --diff or the debugger can replay
+class Fuzzer
+{
+private:
+	static constexpr std::size_t m_maxRom = Ram::size - 0x200;
+
+	std::mutex m_mutex;
+	std::vector<FuzzInput> m_corpus;
+	std::vector<uint32_t> m_seenFaults;		// Fault bit << 16 | PC
+	std::array<std::atomic<uint64_t>, CoverageHooks::bits / 64> m_coverage{};
+	std::atomic<uint64_t> m_execs{};
+	std::atomic<uint64_t> m_edges{};
+	std::atomic<bool> m_stop{false};
+	std::filesystem::path m_outDir;
+	int m_frames;
+
+	// Returns the faults the input raised
+	uint8_t execute(Chip8& chip8, const FuzzInput& in, CoverageHooks& coverage)
+	{
+		chip8.setKeys(0);
+		chip8.loadProgram(in.rom);
+		chip8.seed(1);
+
+		std::size_t next = 0;
+		for (int frame = 0; frame < m_frames; frame++)
+		{
+			while (next < in.keys.size() && static_cast<int>(in.keys[next].frame) <= frame)
+				chip8.setKeys(in.keys[next++].keys);
+
+			runFrame(chip8, Config::normalClockSpeed, coverage);
+		}
+
+		return chip8.getFaults();
+	}
+
+	// Adds the coverage to the global map, returns true if it hit new edges
+	bool merge(const CoverageHooks& coverage)
+	{
+		uint64_t newEdges = 0;
+		for (std::size_t i = 0; i < coverage.map.size(); i++)
+		{
+			const uint64_t bits = coverage.map[i];
+			if (!(bits & ~m_coverage[i].load(std::memory_order_relaxed))) continue;
+
+			const uint64_t old = m_coverage[i].fetch_or(bits, std::memory_order_relaxed);
+			for (uint64_t added = bits & ~old; added; added &= added - 1)
+				newEdges++;
+		}
+
+		m_edges += newEdges;
+		return newEdges > 0;
+	}
+
+	void mutate(FuzzInput& in, const FuzzInput& other, std::mt19937& rng)
+	{
+		auto random = [&](uint32_t n) {return static_cast<uint32_t>(rng() % n);};
+		std::vector<uint8_t>& rom = in.rom;
+
+		for (int count = 1 + random(4); count > 0; count--)
+		{
+			switch (random(9))
+			{
+			// Flip a bit
+			case 0:
+				rom[random(rom.size())] ^= 1 << random(8);
+				break;
+
+			// Random byte
+			case 1:
+				rom[random(rom.size())] = random(256);
+				break;
+
+			// Random instruction
+			case 2:
+				if (rom.size() >= 2)
+				{
+					const std::size_t at = random(rom.size() / 2) * 2;
+					rom[at] = random(256);
+					rom[at + 1] = random(256);
+				}
+				break;
+
+			// Insert an instruction
+			case 3:
+				if (rom.size() + 2 <= m_maxRom)
+				{
+					const std::size_t at = random(rom.size() / 2 + 1) * 2;
+					const uint8_t op[2] = {static_cast<uint8_t>(random(256)), static_cast<uint8_t>(random(256))};
+					rom.insert(rom.begin() + std::min(at, rom.size()), op, op + 2);
+				}
+				break;
+
+			// Delete an instruction
+			case 4:
+				if (rom.size() > 2)
+				{
+					const std::size_t at = random(rom.size() - 1);
+					rom.erase(rom.begin() + at, rom.begin() + at + 2);
+				}
+				break;
+
+			// Copy a chunk of another input over this one
+			case 5:
+			{
+				const std::size_t len = std::min<std::size_t>(1 + random(32), std::min(rom.size(), other.rom.size()));
+				if (len == 0) break;
+				const std::size_t from = random(other.rom.size() - len + 1);
+				const std::size_t to = random(rom.size() - len + 1);
+				std::copy_n(other.rom.begin() + from, len, rom.begin() + to);
+				break;
+			}
+
+			// Press a key at some frame
+			case 6:
+				in.keys.push_back({random(m_frames), static_cast<uint16_t>(1 << random(16))});
+				break;
+
+			// Release everything at some frame
+			case 7:
+				in.keys.push_back({random(m_frames), 0});
+				break;
+
+			// Drop a key event
+			case 8:
+				if (!in.keys.empty())
+					in.keys.erase(in.keys.begin() + random(in.keys.size()));
+				break;
+			}
+		}
+
+		std::stable_sort(in.keys.begin(), in.keys.end(), 
+			[](const InputEvent& a, const InputEvent& b) {return a.frame < b.frame;});
+	}
+
+	// Named after the first fault, the PC belongs to that one
+	void report(const FuzzInput& in, uint8_t firstFault, uint16_t pc)
+	{
+		int kind = 0;
+		while (!((firstFault >> kind) & 1)) kind++;
+
+		const uint32_t key = (1u << kind) << 16 | pc;
+		{
+			std::lock_guard lock{m_mutex};
+			if (std::find(m_seenFaults.begin(), m_seenFaults.end(), key) != m_seenFaults.end())
+				return;
+			m_seenFaults.push_back(key);
+		}
+
+		char name[64];
+		snprintf(name, sizeof(name), "%s_%03X", Fault::names[kind], pc);
+
+		std::ofstream rom{m_outDir / (std::string{name} + ".ch8"), std::ios::binary};
+		rom.write(reinterpret_cast<const char*>(in.rom.data()), in.rom.size());
+
+		std::string keys;
+		for (const InputEvent& ev : in.keys)
+			appendf(keys, "%s%u:%x", keys.empty() ? "" : ",", ev.frame, ev.keys);
+
+		std::ofstream manifest{m_outDir / (std::string{name} + ".txt")};
+		manifest << name << ".ch8 " << m_frames * (Config::normalClockSpeed / 60) << " 1 " << (keys.empty() ? "-" : keys) << '\n';
+
+		printf("New fault %s at 0x%03X, saved to %s\n", Fault::names[kind], pc, (m_outDir / name).string().c_str());
+	}
+
+	void worker(uint32_t seed)
+	{
+		std::mt19937 rng{seed};
+		Chip8 chip8{};
+		CoverageHooks coverage;
+		FuzzInput in, other;
+
+		while (!m_stop)
+		{
+			{
+				std::lock_guard lock{m_mutex};
+				in = m_corpus[rng() % m_corpus.size()];
+				other = m_corpus[rng() % m_corpus.size()];
+			}
+
+			mutate(in, other, rng);
+
+			coverage.map.fill(0);
+			coverage.prev = 0;
+			const uint8_t faults = execute(chip8, in, coverage);
+			m_execs++;
+
+			if (faults)
+				report(in, chip8.getFirstFault(), chip8.getFaultPC());
+
+			if (merge(coverage))
+			{
+				std::lock_guard lock{m_mutex};
+				m_corpus.push_back(in);
+			}
+		}
+	}
+
+public:
+	Fuzzer(const char* outDir, int frames) : m_outDir{outDir}, m_frames{std::max(frames, 1)} {}
+
+	// Seeds come from a rom or from every file in a directory
+	bool addSeeds(const char* path)
+	{
+		std::vector<std::filesystem::path> files;
+		std::error_code error;
+		if (std::filesystem::is_directory(path, error))
+		{
+			for (const auto& entry : std::filesystem::directory_iterator{path, error})
+				if (entry.is_regular_file())
+					files.push_back(entry.path());
+		}
+		else
+		{
+			files.push_back(path);
+		}
+
+		for (const std::filesystem::path& file : files)
+		{
+			FuzzInput in;
+			if (Chip8::readProgram(file.string().c_str(), in.rom) && !in.rom.empty())
+				m_corpus.push_back(std::move(in));
+		}
+
+		if (m_corpus.empty())
+		{
+			SDL_Log("No usable seed roms in \"%s\"\n", path);
+			return false;
+		}
+
+		return true;
+	}
+
+	// Fuzzes for the given amount of seconds, 0 runs until the process is killed
+	void run(int seconds, int jobs)
+	{
+		std::error_code error;
+		std::filesystem::create_directories(m_outDir, error);
+
+		std::vector<std::thread> workers;
+		for (int i = 0; i < jobs; i++)
+			workers.emplace_back(&Fuzzer::worker, this, 0xF022u + i);
+
+		const auto start = std::chrono::steady_clock::now();
+		uint64_t lastExecs = 0;
+		for (int elapsed = 1; seconds == 0 || elapsed <= seconds; elapsed++)
+		{
+			std::this_thread::sleep_until(start + std::chrono::seconds(elapsed));
+
+			const uint64_t execs = m_execs;
+			std::size_t corpus, faults;
+			{
+				std::lock_guard lock{m_mutex};
+				corpus = m_corpus.size();
+				faults = m_seenFaults.size();
+			}
+
+			printf("[%4ds] %llu execs, %llu/s, %zu inputs, %llu edges, %zu faults\n", elapsed,
+					static_cast<unsigned long long>(execs), static_cast<unsigned long long>(execs - lastExecs), 
+					corpus, static_cast<unsigned long long>(m_edges.load()), faults);
+			fflush(stdout);
+			lastExecs = execs;
+		}
+
+		m_stop = true;
+		for (std::thread& worker : workers)
+			worker.join();
 	}
+};
+
+// Runs a crowd of machines headless to see how densely they pack. Every 
+// worker is pinned to a core and owns an arena on that core's NUMA node. The
+// machines are forks of one template, so the rom pages stay shared until a 
+// machine writes to them
+bool runHost(const char* romPath, int instances, int frames)
+{
+	Chip8 base{};
+	if (!base.loadProgram(romPath)) return false;
+
+	const std::vector<std::vector<int>> nodes = Numa::nodes();
+	std::vector<int> cpus;
+	for (const std::vector<int>& node : nodes)
+		cpus.insert(cpus.end(), node.begin(), node.end());
+
+	const int threads = std::clamp<int>(cpus.size(), 1, instances);
+
+	struct Result
+	{
+		std::size_t used{};
+		std::size_t reserved{};
+		bool huge{};
+		bool pinned{};
+	};
+	std::vector<Result> results(threads);
+	std::atomic<int> ready{0};
+	std::atomic<bool> go{false};
+
+	// Every machine hits the same bad opcodes, one log line each would drown it
+	SDL_LogSetPriority(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_CRITICAL);
+
+	std::vector<std::thread> workers;
+	for (int t = 0; t < threads; t++)
+		workers.emplace_back([&, t]()
+		{
+			Result& result = results[t];
+			result.pinned = Numa::pinThread(cpus[t]);
+
+			Arena arena;
+			PagePool::attach(&arena);
+			{
+				Chip8Pool pool{&arena};
+				std::vector<Chip8*> machines;
+				for (int i = instances * t / threads; i < instances * (t + 1) / threads; i++)
+				{
+					machines.push_back(pool.fork(base));
+					machines.back()->seed(i + 1);
+				}
+
+				ready++;
+				while (!go)
+					std::this_thread::yield();
+
+				for (int frame = 0; frame < frames; frame++)
+					for (Chip8* c8 : machines)
+						runFrame(*c8, Config::normalClockSpeed);
+
+				result.used = arena.used();
+				result.reserved = arena.reserved();
+				result.huge = arena.hugePages();
+
+				for (Chip8* c8 : machines)
+					pool.release(c8);
+			}
+			PagePool::detach(&arena);
+		});
+
+	while (ready < threads)
+		std::this_thread::yield();
+
+	const auto start = std::chrono::steady_clock::now();
+	go = true;
+	for (std::thread& worker : workers)
+		worker.join();
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	SDL_LogSetPriority(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_INFO);
+
+	std::size_t used = 0, reserved = 0;
+	int pinned = 0, huge = 0;
+	for (const Result& result : results)
+	{
+		used += result.used;
+		reserved += result.reserved;
+		pinned += result.pinned;
+		huge += result.huge;
+	}
+
+	const double aggregate = static_cast<double>(instances) * frames / seconds;
+	SDL_Log("Hosted %d machines for %d frames on %d threads (%d pinned) over %zu NUMA nodes\n", 
+			instances, frames, threads, pinned, nodes.size());
+	SDL_Log("%.0f bytes per machine, %zu without shared pages, arenas %.1f MB of %.1f MB reserved, %d/%d on huge pages\n",
+			static_cast<double>(used) / instances, sizeof(Chip8) + Ram::pageCount * sizeof(RamPage), 
+			used / 1048576.0, reserved / 1048576.0, huge, threads);
+	SDL_Log("%.0f frames/s aggregate, %.0f per thread, %.2f s\n", aggregate, aggregate / threads, seconds);
+
+	return true;
 }
 
 // Startup arguments handler function
 bool handleArgs(const int argc, char* argv[])
 {
-	// TODO: add more args
+	for (int i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--run-ahead") && i + 1 < argc)
+		{
+			Config::runAheadFrames = std::clamp(atoi(argv[++i]), 0, Config::maxRunAheadFrames);
+		}
+		else if (!strcmp(argv[i], "--profile") && i + 1 < argc)
+		{
+			Config::profileInterval = std::max(atoi(argv[++i]), 1);
+		}
+		else if (!strcmp(argv[i], "--debug"))
+		{
+			Config::debugger = true;
+		}
+		else if (!strcmp(argv[i], "--seed") && i + 1 < argc)
+		{
+			Config::seed = strtoul(argv[++i], nullptr, 0);
+		}
+		else if (!strcmp(argv[i], "--netplay") && i + 2 < argc)
+		{
+			Config::netLocalPort = atoi(argv[++i]);
+			Config::netPeer = argv[++i];
+		}
+		else if (!strcmp(argv[i], "--net-delay") && i + 1 < argc)
+		{
+			Config::netDelayMs = std::max(atoi(argv[++i]), 0);
+		}
+		else if (!strcmp(argv[i], "--net-jitter") && i + 1 < argc)
+		{
+			Config::netJitterMs = std::max(atoi(argv[++i]), 0);
+		}
+		else if (!strcmp(argv[i], "--fuzz") && i + 1 < argc)
+		{
+			Config::fuzzPath = argv[++i];
+		}
+		else if (!strcmp(argv[i], "--fuzz-time") && i + 1 < argc)
+		{
+			Config::fuzzSeconds = std::max(atoi(argv[++i]), 0);
+		}
+		else if (!strcmp(argv[i], "--fuzz-jobs") && i + 1 < argc)
+		{
+			Config::fuzzJobs = std::max(atoi(argv[++i]), 0);
+		}
+		else if (!strcmp(argv[i], "--fuzz-frames") && i + 1 < argc)
+		{
+			Config::fuzzFrames = std::max(atoi(argv[++i]), 1);
+		}
+		else if (!strcmp(argv[i], "--fuzz-out") && i + 1 < argc)
+		{
+			Config::fuzzOut = argv[++i];
+		}
+		else if (!strcmp(argv[i], "--host") && i + 1 < argc)
+		{
+			Config::hostInstances = std::max(atoi(argv[++i]), 1);
+		}
+		else if (!strcmp(argv[i], "--frames") && i + 1 < argc)
+		{
+			Config::hostFrames = std::max(atoi(argv[++i]), 1);
+		}
+		else if (!strcmp(argv[i], "--hot-reload"))
+		{
+			Config::hotReload = true;
+		}
+		else if (!strcmp(argv[i], "--keep-state"))
+		{
+			Config::hotReload = true;
+			Config::keepState = true;
+		}
+		else if (!strcmp(argv[i], "--diff") && i + 1 < argc)
+		{
+			Config::diffPath = argv[++i];
+		}
+		else if (!strcmp(argv[i], "--engines") && i + 1 < argc)
+		{
+			Config::diffEngines = argv[++i];
+		}
+		else if (!strcmp(argv[i], "--diff-interval") && i + 1 < argc)
+		{
+			Config::diffInterval = std::max(atoi(argv[++i]), 1);
+		}
+		else if ((!strcmp(argv[i], "--golden") || !strcmp(argv[i], "--golden-record")) && i + 1 < argc)
+		{
+			Config::goldenRecord = !strcmp(argv[i], "--golden-record");
+			Config::goldenPath = argv[++i];
+		}
+		else if (argv[i][0] == '-')
+		{
+			SDL_Log("Unknown option %s\n", argv[i]);
+			return false;
+		}
+		else
+		{
+			Config::romPath = argv[i];
+		}
+	}
+
+	if (Config::goldenPath || Config::diffPath || Config::fuzzPath)
+		return true;
+
+	if (Config::debugger && Config::profileInterval > 0)
+	{
+		SDL_Log("--debug and --profile can not be used together\n");
+		return false;
+	}
+
+	// The peer only sees what Netplay::runFrame plays, tools that run or 
+	// change the machine on their own would desync the players
+	if (Config::netLocalPort && (Config::debugger || Config::profileInterval || Config::hotReload || Config::keepState))
+	{
+		SDL_Log("--netplay can't be used with --debug, --profile, --hot-reload or --keep-state\n");
+		return false;
+	}
 
-	if (argc < 2)
+	// Both players have to roll the same random numbers
+	if (Config::netLocalPort && !Config::seed)
+		Config::seed = 0xC8C8;
+
+	if (!Config::romPath)
 	{
-		SDL_Log("Usage: %s <rom name>\n", argv[0]);
+		SDL_Log("Usage: %s <rom name> [--run-ahead <frames>] [--profile <interval>] [--debug]\n"
+				"       [--hot-reload] [--keep-state] [--seed <n>]\n"
+				"       [--netplay <local port> <peer host:port> [--net-delay <ms>] [--net-jitter <ms>]]\n", argv[0]);
+		SDL_Log("       %s <rom name> --host <machines> [--frames <n>]\n", argv[0]);
+		SDL_Log("       %s --golden|--golden-record <manifest>\n", argv[0]);
+		SDL_Log("       %s --diff <manifest> [--engines <a,b>] [--diff-interval <instructions>]\n", argv[0]);
+		SDL_Log("       %s --fuzz <rom|dir> [--fuzz-time <s>] [--fuzz-jobs <n>] [--fuzz-frames <n>] [--fuzz-out <dir>]\n", argv[0]);
 		return false;
 	}
 
-	Config::romPath = argv[1];
-	SDL_Log("Running %s\n", argv[1]);
+	SDL_Log("Running %s\n", Config::romPath);
 
 	return true;
 }
@@ -861,13 +3895,39 @@ void clean(sdl_t& sdl)
 	SDL_Quit();
 }
 
+// Tests include this file and bring their own main
+#ifndef CHIP8_NO_MAIN
 // Datz mein
 int main(int argc, char* argv[])
 {
 	if (!handleArgs(argc, argv)) return 1;
 
+	if (Config::goldenPath)
+		return runGolden(Config::goldenPath, Config::goldenRecord) ? 0 : 1;
+
+	if (Config::diffPath)
+		return runDiff(Config::diffPath, Config::diffEngines, Config::diffInterval) ? 0 : 1;
+
+	if (Config::fuzzPath)
+	{
+		Fuzzer fuzzer{Config::fuzzOut, Config::fuzzFrames};
+		if (!fuzzer.addSeeds(Config::fuzzPath)) return 1;
+
+		// Random roms hit the invalid opcode logs all the time
+		SDL_LogSetPriority(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_CRITICAL);
+
+		const int jobs = Config::fuzzJobs ? Config::fuzzJobs : std::max<int>(std::thread::hardware_concurrency(), 1);
+		fuzzer.run(Config::fuzzSeconds, jobs);
+		return 0;
+	}
+
+	if (Config::hostInstances)
+		return runHost(Config::romPath, Config::hostInstances, Config::hostFrames) ? 0 : 1;
+
 	sdl_t sdl{};
 	Chip8 chip8{};
+	if (Config::seed)
+		chip8.seed(Config::seed);
 
 	if (!init(sdl, chip8)) return 1;
 
@@ -876,3 +3936,4 @@ int main(int argc, char* argv[])
 	clean(sdl);
 	return 0;
 }
+#endif
@@ -0,0 +1,90 @@
+// Two netplay peers on localhost, one of them starting a few frames ahead.
+// Inputs of the peer that arrive before a frame is played must not get lost,
+// so both machines have to end in the same state for every lead the rollback
+// window allows
+#define CHIP8_NO_MAIN
+#include "../main.cpp"
+
+namespace NetplayTest
+{
+	// Adds the index of every held key to V1, forever
+	const std::vector<uint8_t> program = {
+		0x62, 0x00,		// V2 = 0
+		0xE2, 0x9E,		// Skip if key V2 is down
+		0x12, 0x08,		// Jump to 0x208
+		0x81, 0x24,		// V1 += V2
+		0x72, 0x01,		// V2 += 1
+		0x42, 0x10,		// Skip if V2 != 16
+		0x12, 0x00,		// Jump to 0x200
+		0x12, 0x02,		// Jump to 0x202
+	};
+
+	constexpr int frames = 300;
+	constexpr int quietFrames = 30;		// Nobody presses anything at the end so the last guesses are right
+	constexpr uint16_t basePort = 47010;
+
+	uint16_t keysOf(int player, int64_t frame)
+	{
+		if (frame >= frames - quietFrames) return 0;
+		return 1 << ((frame * (player ? 5 : 7) + player) % 16);
+	}
+
+	void step(Netplay& peer, Chip8& chip8, int player)
+	{
+		chip8.setKeys(keysOf(player, peer.getFrame()));
+		peer.runFrame(chip8);
+
+		// Let the packet reach the other peer
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	bool run(int lead)
+	{
+		Chip8 machines[2];
+		Netplay peers[2]{{0, 0}, {0, 0}};
+		const uint16_t port = basePort + lead * 2;
+
+		for (int p = 0; p < 2; p++)
+		{
+			machines[p].seed(0xC8C8);
+			machines[p].loadProgram(program);
+			if (!peers[p].start(machines[p], port + p, "127.0.0.1", port + 1 - p))
+			{
+				printf("FAIL lead %d: could not open port %u\n", lead, port + p);
+				return false;
+			}
+		}
+
+		for (int i = 0; i < lead; i++)
+			step(peers[0], machines[0], 0);
+
+		for (int guard = 0; guard < frames * 4 && (peers[0].getFrame() < frames || peers[1].getFrame() < frames); guard++)
+			for (int p = 0; p < 2; p++)
+				if (peers[p].getFrame() < frames)
+					step(peers[p], machines[p], p);
+
+		const Chip8& a = machines[0];
+		const Chip8& b = machines[1];
+		if (a.registersHash() != b.registersHash() || a.ramHash() != b.ramHash() || a.displayHash() != b.displayHash())
+		{
+			printf("FAIL lead %d: V1=%X vs V1=%X after frames %lld and %lld\n", lead, a.getV(1), b.getV(1),
+					static_cast<long long>(peers[0].getFrame()), static_cast<long long>(peers[1].getFrame()));
+			return false;
+		}
+
+		printf("PASS lead %d\n", lead);
+		return true;
+	}
+}
+
+int main(int, char*[])
+{
+	// The peers log their stats every second
+	SDL_LogSetPriority(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_CRITICAL);
+
+	int failed = 0;
+	for (int lead : {0, 1, 3, 5, 7})
+		failed += !NetplayTest::run(lead);
+
+	return failed ? 1 : 0;
+}